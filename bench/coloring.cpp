@@ -0,0 +1,103 @@
+// Measures cache conflict misses between objects at the same offset in
+// different chunks.
+//
+// Allocates objects of one size class until HOT chunks have been started,
+// keeping the first object of each chunk (assuming 64KB-aligned chunks,
+// as in checkheap3). Without chunk coloring those objects all sit at the
+// same offset modulo 64KB and compete for the same cache sets. It then
+// reads one cache line of each, round after round, and reports L1D read
+// misses and cycles per access from perf counters, and the time per
+// access.
+//
+// Run it against builds with different CHECK_HEAP_CHUNK_COLORS, e.g.
+//   LD_PRELOAD=../libcheckedheap.so ./coloring 512 64
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static int open_counter(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t read_counter(int fd) {
+  uint64_t value = 0;
+  if (fd == -1 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+    return 0;
+  }
+  return value;
+}
+
+int main(int argc, char** argv) {
+  const size_t size = argc > 1 ? atol(argv[1]) : 512;
+  const size_t HOT = argc > 2 ? atol(argv[2]) : 64;
+  const size_t ROUNDS = 100000;
+  const uintptr_t CHUNK = 1 << 16;
+
+  volatile char** hot = (volatile char**)calloc(HOT, sizeof(char*));
+  size_t found = 0;
+  uintptr_t last_chunk = 0;
+  while (found < HOT) {
+    char* obj = (char*)malloc(size);
+    memset(obj, 1, size);
+    if ((uintptr_t)obj / CHUNK != last_chunk) {
+      last_chunk = (uintptr_t)obj / CHUNK;
+      hot[found++] = obj;
+    }
+  }
+
+  size_t distinct = 0;
+  for (size_t i = 0; i < HOT; ++i) {
+    bool seen = false;
+    for (size_t j = 0; j < i && !seen; ++j) {
+      seen = ((uintptr_t)hot[i] % CHUNK) == ((uintptr_t)hot[j] % CHUNK);
+    }
+    distinct += !seen;
+  }
+
+  int misses = open_counter(PERF_TYPE_HW_CACHE,
+                            PERF_COUNT_HW_CACHE_L1D |
+                            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  int cycles = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  if (misses == -1 || cycles == -1) {
+    fprintf(stderr, "perf counters unavailable; reporting time only.\n");
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ioctl(misses, PERF_EVENT_IOC_ENABLE, 0);
+  ioctl(cycles, PERF_EVENT_IOC_ENABLE, 0);
+  unsigned long sum = 0;
+  for (size_t r = 0; r < ROUNDS; ++r) {
+    for (size_t i = 0; i < HOT; ++i) {
+      sum += hot[i][0];
+    }
+  }
+  ioctl(misses, PERF_EVENT_IOC_DISABLE, 0);
+  ioctl(cycles, PERF_EVENT_IOC_DISABLE, 0);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  const double accesses = (double)ROUNDS * HOT;
+  printf("size %zu, %zu hot objects at %zu distinct offsets mod 64KB\n",
+         size, HOT, distinct);
+  printf("L1D misses/access: %.3f\n", read_counter(misses) / accesses);
+  printf("cycles/access: %.2f\n", read_counter(cycles) / accesses);
+  printf("ns/access: %.2f\n",
+         ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / accesses);
+  return sum == 0;
+}
@@ -0,0 +1,130 @@
+// Counts miniheap probes per allocation in the randomized engine
+// (RandomCheckedHeap) as a size class fills up towards its growth
+// threshold, where live objects are Denominator/Numerator of capacity.
+//
+// The heap is grown once, then held at a series of fullness levels
+// (live objects over capacity). At each level the oldest half of the
+// objects, which sit mostly in the first, smallest miniheaps, live on
+// while the rest are freed and reallocated at random. It reports the
+// mean and worst number of miniheap malloc calls per allocation; 1
+// means every first probe succeeded.
+//
+// Built directly against the headers, e.g.
+//   g++ -O2 -I../include -I../Heap-Layers probes.cpp -o probes
+// Add -DUSE_SHUFFLE_VECTOR=0 for bitmap probing within miniheaps, and
+// -DPICK_BY_FREE_OBJECTS=0 for the old miniheap selection, by capacity,
+// as a baseline.
+
+#include <heaplayers.h>
+#include <checkedheap.h>
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static unsigned long long probes;
+static unsigned long long capacity;
+
+// A miniheap that counts its malloc calls and its objects.
+template <int Numerator,
+          int Denominator,
+          unsigned long ObjectSize,
+          unsigned long NObjects,
+          class Allocator>
+class CountingMiniHeap :
+  public RandomMiniCheckedHeap<Numerator, Denominator, ObjectSize, NObjects, Allocator> {
+  typedef RandomMiniCheckedHeap<Numerator, Denominator, ObjectSize, NObjects, Allocator> Base;
+ public:
+  void* malloc(size_t sz) {
+    probes++;
+    return Base::malloc(sz);
+  }
+  void activate() {
+    capacity += NObjects;
+    Base::activate();
+  }
+};
+
+template <class Heap>
+static Heap& heapInstance() {
+  static Heap heap;
+  return heap;
+}
+
+// Miniheaps stay protected until touched; a fault on one registers the
+// access and unprotects it, as in the library.
+static bool (*registerAccess)(void*);
+
+template <class Heap>
+static bool registerWith(void* addr) {
+  return heapInstance<Heap>().register_access(addr);
+}
+
+static void onFault(int, siginfo_t* info, void*) {
+  if (!registerAccess(info->si_addr)) {
+    signal(SIGSEGV, SIG_DFL);
+  }
+}
+
+template <int Numerator, int Denominator>
+static void run() {
+  enum { ObjectSize = 64 };
+  typedef RandomCheckedHeap<Numerator, Denominator, ObjectSize, 1 << 16, CountingMiniHeap> Heap;
+  Heap& heap = heapInstance<Heap>();
+  registerAccess = registerWith<Heap>;
+  capacity = 0;
+
+  std::vector<void*> live;
+  for (size_t i = 0; i < (1 << 18); ++i) {
+    live.push_back(heap.malloc(ObjectSize));
+  }
+  // The heap does not grow again below this many live objects.
+  const double threshold = (double) capacity * Denominator / Numerator;
+
+  printf("Numerator/Denominator = %d/%d, capacity %llu objects\n",
+         Numerator, Denominator, capacity);
+  printf("fullness  mean probes  worst\n");
+  for (int pct = 5; pct <= 100; pct += 5) {
+    size_t target = (size_t) (threshold * (pct == 100 ? 0.99 : pct / 100.0));
+    // Newest objects go first, as when a burst of temporaries dies;
+    // they sit mostly in the largest miniheaps.
+    while (live.size() > target) {
+      heap.free(live.back());
+      live.pop_back();
+    }
+    while (live.size() < target) {
+      live.push_back(heap.malloc(ObjectSize));
+    }
+    const size_t ROUNDS = 200000;
+    unsigned long long total = 0, worst = 0;
+    // The oldest half of the objects live on; the rest churn.
+    const size_t oldest = live.size() / 2;
+    for (size_t r = 0; r < ROUNDS; ++r) {
+      size_t i = oldest + random() % (live.size() - oldest);
+      heap.free(live[i]);
+      unsigned long long before = probes;
+      live[i] = heap.malloc(ObjectSize);
+      unsigned long long n = probes - before;
+      total += n;
+      worst = (n > worst) ? n : worst;
+    }
+    printf("%7.2f   %11.2f  %5llu\n",
+           (double) live.size() / capacity, (double) total / ROUNDS, worst);
+  }
+  for (size_t i = 0; i < live.size(); ++i) {
+    heap.free(live[i]);
+  }
+}
+
+int main() {
+  struct sigaction sa;
+  sa.sa_sigaction = onFault;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO;
+  sigaction(SIGSEGV, &sa, NULL);
+
+  run<2, 1>();
+  run<9, 8>();
+  return 0;
+}
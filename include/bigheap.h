@@ -0,0 +1,62 @@
+// -*- C++ -*-
+
+#ifndef __INCLUDE_BIGHEAP_H__
+#define __INCLUDE_BIGHEAP_H__
+
+#include <regionheap.h>
+
+// Large objects, each in its own run of pages with a trailing guard
+// page, carved from one reserved range. Freed runs are discarded and
+// protected at once, then quarantined behind later frees of similar
+// size, up to QuarantineBytes of address space in all (see
+// ProtectedPageAllocator), so use-after-free faults while the
+// quarantine costs no physical memory. With RightAlign, objects end
+// against their guard page instead of starting at the run's first page.
+// Ownership is a range check.
+// Requests the range cannot satisfy go to FallbackHeap. free() returns
+// false for pointers that neither owns, so the caller reports them.
+template <class FallbackHeap,
+          size_t PageSize,
+          size_t HeapSize,
+          size_t QuarantineBytes,
+          bool RightAlign = false>
+class BigHeap : public FallbackHeap {
+  // Freed runs skip the deferred cache: a quarantined run must already
+  // be protected. No fast bins either: every run here is bigger than
+  // the largest of them, and the quarantine already keeps freed runs
+  // from being reused straight away.
+  typedef ProtectedPageAllocator<FallbackHeap, 4, PageSize, HeapSize, 0, QuarantineBytes, RightAlign, false> Pages;
+
+ public:
+  enum { Alignment = Pages::Alignment };
+
+  inline void* malloc(size_t sz) {
+    void* ptr = _pages.malloc(sz);
+    if (ptr == NULL) {
+      ptr = FallbackHeap::malloc(sz);
+    }
+    return ptr;
+  }
+
+  inline bool free(void* ptr) {
+    if (_pages.owns(ptr)) {
+      return _pages.free(ptr);
+    }
+    if (FallbackHeap::getSize(ptr) == 0) {
+      return false;
+    }
+    return FallbackHeap::free(ptr);
+  }
+
+  inline size_t getSize(void* ptr) {
+    if (_pages.owns(ptr)) {
+      return _pages.getSize(ptr);
+    }
+    return FallbackHeap::getSize(ptr);
+  }
+
+ private:
+  Pages _pages;
+};
+
+#endif
@@ -11,6 +11,7 @@
 
 #include "diefast.h"
 #include <static/staticforloop.h>
+#include <static/staticswitch.h>
 #include <math/halflog2.h>
 #include <math/log2.h>
 #include <util/platformspecific.h>
@@ -69,7 +70,7 @@ public:
     // Alignment, then the next holds objects of size
     // 2*Alignment, etc. See the Initializer class
     // below.
-    StaticForLoop<0, MAX_INDEX, Initializer, void *>::run ((void *) _buf);
+    StaticForLoop<0, MAX_INDEX, Initializer, HeapSlot *>::run (_heaps);
 
     // Initialize bitmap access.
     _accessMap.clear();
@@ -79,7 +80,7 @@ public:
     // Only validate those heaps who have been accessed.
     for (int i = 0; i < MAX_INDEX; ++i) {
       if (_accessMap.isSet(i)) {
-        getHeap(i)->validate();
+        dispatch<Validate, void> (i, Call (this));
       }
     }
   }
@@ -87,7 +88,7 @@ public:
   inline void reset_access() {
     for (int i = 0; i < MAX_INDEX; ++i) {
       if (_accessMap.reset(i)) {
-        getHeap(i)->reset_access();
+        dispatch<ResetAccess, void> (i, Call (this));
       }
     }
   }
@@ -113,7 +114,7 @@ public:
     int index = getIndex (sz);
     size_t actualSize = getClassSize (index);
 
-    void * ptr = getHeap(index)->malloc (actualSize);
+    void * ptr = dispatch<Malloc, void *> (index, Call (this, NULL, actualSize));
 
     DieFast::fill (ptr, actualSize, _localRandomValue);
     
@@ -125,7 +126,7 @@ public:
   // Returns true if handled, false if not
   inline bool register_access(void *ptr) {
     for (int i = 0; i < MAX_INDEX; ++i) {
-      if (getHeap(i)->register_access(ptr)) {
+      if (dispatch<RegisterAccess, bool> (i, Call (this, ptr))) {
         _accessMap.tryToSet(i);
         return true;
       }
@@ -141,7 +142,7 @@ public:
     // We assume that the common case is when objects are small,
     // so we check the smaller heaps first.
     for (int i = 0; i < MAX_INDEX; i++) {
-      if (getHeap(i)->free (ptr))
+      if (dispatch<Free, bool> (i, Call (this, ptr)))
 	// Successfully freed.
 	return true;
     }
@@ -153,11 +154,11 @@ public:
   /// @brief Gets the size of a heap object.
   /// @return the space available from this point in the given object
   /// @note returns 0 if this object is not managed by this heap
-  inline size_t getSize (void * ptr) const {
+  inline size_t getSize (void * ptr) {
     // Iterate, from smallest to largest, checking for the given
     // object size.
     for (int i = 0; i < MAX_INDEX; i++) {
-      size_t sz = getHeap(i)->getSize (ptr);
+      size_t sz = dispatch<GetSize, size_t> (i, Call (this, ptr));
       if (sz != 0) {
         return sz;
       }
@@ -212,41 +213,110 @@ private:
     return index;
   }
 
+  /// The type of the heap for the given index (size class).
   template <int index>
-  class Initializer {
+  class HeapAt {
   public:
-    static void run (void * buf) {
-      new ((char *) buf + MINIHEAPSIZE * index)
-	RandomCheckedHeap<Numerator,
-                    Denominator,
+    typedef RandomCheckedHeap<Numerator,
+                              Denominator,
 #if USE_HALF_LOG
-                    // NOTE: wasting some indices up front here....
+                              // NOTE: wasting some indices up front here....
 
-                    StaticHalfPow2<index>::VALUE, // NB: = getClassSize(index)
+                              StaticHalfPow2<index>::VALUE, // NB: = getClassSize(index)
 #else
-	                  (1 << index) * Alignment, // NB: = getClassSize(index)
+                              (1 << index) * Alignment, // NB: = getClassSize(index)
 #endif
-                    MaxSize,
-                    RandomMiniCheckedHeap>();
+                              MaxSize,
+                              RandomMiniCheckedHeap> Type;
+  };
+
+  /// Room for one heap. The heaps differ only in their object size, so
+  /// every HeapAt type has the first one's size and alignment.
+  struct HeapSlot {
+    alignas (typename HeapAt<0>::Type) char bytes[sizeof (typename HeapAt<0>::Type)];
+  };
+
+  template <int index>
+  class Initializer {
+  public:
+    static void run (HeapSlot * slots) {
+      typedef typename HeapAt<index>::Type Type;
+      sassert<(sizeof(Type) <= sizeof(HeapSlot)) &&
+              (alignof(HeapSlot) % alignof(Type) == 0)> verifyFitsSlot;
+      verifyFitsSlot = verifyFitsSlot;
+      new (slots[index].bytes) Type();
     }
   };
 
   /// @return the heap corresponding to the given index.
-  inline RandomHeapBase<Numerator, Denominator> * getHeap (int index) const {
+  template <int index>
+  inline typename HeapAt<index>::Type * getHeap (void) {
     // Return the requested heap.
+    return reinterpret_cast<typename HeapAt<index>::Type *> (_heaps[index].bytes);
+  }
+
+  // Calls on the heaps go through dispatch(), which switches on the
+  // index to the right HeapAt type, so they can be inlined.
+
+  /// The heap and arguments of a call to one of its size classes.
+  class Call {
+  public:
+    Call (CheckedHeap * h, void * p = NULL, size_t s = 0)
+      : heap (h), ptr (p), sz (s) {}
+    CheckedHeap * heap;
+    void * ptr;
+    size_t sz;
+  };
+
+  /// @return the result of Op on the heap with the given index.
+  template <template <int> class Op, typename R>
+  static inline R dispatch (int index, Call c) {
     assert (index >= 0);
     assert (index < MAX_INDEX);
-    return (RandomHeapBase<Numerator, Denominator> *) &_buf[MINIHEAPSIZE * index];
+    return StaticSwitch<0, MAX_INDEX, Op, R, Call>::run (index, c);
   }
 
-  enum { MINIHEAPSIZE = 
-	 sizeof(RandomCheckedHeap<Numerator, Denominator, Alignment, MaxSize, RandomMiniCheckedHeap>) };
+  template <int index>
+  class Malloc {
+  public:
+    static void * run (Call c) { return c.heap->template getHeap<index>()->malloc (c.sz); }
+  };
+
+  template <int index>
+  class Free {
+  public:
+    static bool run (Call c) { return c.heap->template getHeap<index>()->free (c.ptr); }
+  };
+
+  template <int index>
+  class GetSize {
+  public:
+    static size_t run (Call c) { return c.heap->template getHeap<index>()->getSize (c.ptr); }
+  };
+
+  template <int index>
+  class RegisterAccess {
+  public:
+    static bool run (Call c) { return c.heap->template getHeap<index>()->register_access (c.ptr); }
+  };
+
+  template <int index>
+  class Validate {
+  public:
+    static void run (Call c) { c.heap->template getHeap<index>()->validate(); }
+  };
+
+  template <int index>
+  class ResetAccess {
+  public:
+    static void run (Call c) { c.heap->template getHeap<index>()->reset_access(); }
+  };
 
   /// A random value used for detecting overflows (for DieFast).
   const size_t _localRandomValue;
 
-  // The buffer that holds each RandomHeap.
-  char _buf[MINIHEAPSIZE * MAX_INDEX];
+  // The storage that holds each RandomHeap.
+  HeapSlot _heaps[MAX_INDEX];
 
   // Access map for each random heap.
   StaticBitMap<MAX_INDEX> _accessMap;
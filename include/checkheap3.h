@@ -1,10 +1,76 @@
 #ifndef __INCLUDE_CHECKHEAP3_H__
 #define __INCLUDE_CHECKHEAP3_H__
 
+#include <diefast.h>
 #include <malloc_error.h>
 #include <math/log2.h>
+#include <rng/realrandomvalue.h>
 #include <static/staticlog.h>
 #include <static/checkpoweroftwo.h>
+#include <util/guardpages.h>
+#include <util/madvisewrapper.h>
+#include <util/numa.h>
+#include <util/shadowmap.h>
+
+// GuardSize bytes (a whole number of pages) at the end of every chunk
+// are made inaccessible when the chunk is set up, and objects end at
+// most (Colors - 1) cache lines short of them (see below), so an
+// overflow off the end of a chunk faults instead of corrupting the next
+// chunk's metadata. Where guards split the heap's
+// mapping (see GuardPages), each costs two mappings, so only the first
+// MAX_SPLIT_GUARDS chunks get one.
+//
+// With ValidateOnMalloc, freed objects are filled with a random canary
+// and checked when they leave the quarantine, so a write to a freed
+// object is reported when the object is reused. Objects larger than
+// 2 * SAMPLE_BYTES only have their first and last SAMPLE_BYTES filled
+// and checked.
+//
+// With UseShadow, a ShadowMap over the heap records the requested bytes
+// of every live object as addressable, the rest of its size class as a
+// redzone, and freed objects as such. validate() checks the shadow alone
+// against each object's allocation state, without touching the objects.
+// Their contents are checked as they change state: malloc fills the
+// first SAMPLE_BYTES of each redzone with REDZONE_FILL and free checks
+// it, so a write past the requested size is reported when the object is
+// freed; free canary-fills the object and malloc checks it on reuse, as
+// with ValidateOnMalloc.
+//
+// A freed object waits in its size's FIFO quarantine until Quarantine
+// more objects of that size have been freed, then moves onto a LIFO
+// pool of at most POOL_LIMIT objects. malloc serves the pool first, so
+// the memory it reuses is the most recently released and most likely
+// still cached. While the pool is full, released objects stay at the
+// head of the quarantine, and malloc takes them from there, oldest
+// first, once the pool runs dry.
+//
+// Successive chunks of a size class end their object arrays at one of
+// Colors different cache-line offsets from the chunk's end, so object i
+// of each chunk does not map to the same cache sets. The cost is up to
+// (Colors - 1) cache lines of slack between the last object and the
+// guard. The slack holds the canary, checked when the chunk's last
+// object is freed and by validate(), so an overflow into it is still
+// reported, though no longer by a fault at the offending write.
+//
+// With HugePages, the heap is 2MB-aligned and advised for transparent
+// huge pages. A guard page inside a 2MB unit would keep that unit on
+// 4KB pages, so per-chunk guards are replaced by a whole guard huge page
+// at the end of every HUGE_GROUP_SIZE of heap; chunks never straddle it.
+//
+// With MaxNodes > 1, the heap is split into one range per NUMA node (up
+// to MaxNodes), each preferring its own node's memory and keeping its
+// own quarantines, pools and carve cursors. malloc serves the calling
+// thread's node; free returns an object to the range it came from,
+// whichever thread frees it. A node whose range is full carves chunks
+// from another's. On a single-node machine there is one range, exactly
+// as with MaxNodes = 1.
+//
+// A maintenance thread may keep spare chunks ready for the classes that
+// have been starting chunks recently (see reserveSpares()), so that the
+// allocating thread neither sets up metadata nor faults in fresh memory.
+// The handler given to onSpareDemand() is called whenever a class starts
+// a chunk, which leaves it short of spares, so that the thread can sleep
+// until then.
 
 template <class SourceHeap,
           size_t HeapSize,
@@ -12,25 +78,82 @@ template <class SourceHeap,
           size_t Quarantine,
           size_t MinSize,
           size_t MaxSize,
-          size_t Align>
+          size_t Align,
+          size_t GuardSize = 0,
+          bool ValidateOnMalloc = false,
+          bool UseShadow = false,
+          size_t Colors = 1,
+          bool HugePages = false,
+          size_t MaxNodes = 1>
 class CheckedHeap : public SourceHeap {
  public:
   enum { Alignment = Align };
-  enum { MAX_SIZE = 2048 };
-
-  CheckedHeap() : _allocated(0) {
+  enum { MAX_SIZE = MaxSize };
+
+  CheckedHeap()
+    : // On 64-bit platforms, the 32-bit random value fills both halves.
+      _canary(((size_t) RealRandomValue::value() | 1) * (~(size_t) 0 / 0xFFFFFFFF)),
+      _split_guards(0),
+      _spare_demand(NULL)
+  {
     _mem = SourceHeap::malloc(HeapSize);
     uintptr_t mem_addr = (uintptr_t) _mem;
 
-    // align to nearest chunk.
-    uintptr_t aligned_mem = (mem_addr + ChunkSize - 1) & (~(ChunkSize-1));
+    // align to nearest chunk, or huge page.
+    const uintptr_t align = HugePages ? (uintptr_t) HUGE_PAGE_SIZE : ChunkSize;
+    uintptr_t aligned_mem = (mem_addr + align - 1) & (~(align-1));
     
     _num_chunks = (HeapSize - (aligned_mem - mem_addr)) / ChunkSize;
     _heap = (uint8_t*)(aligned_mem);
 
-    // Initialize lists
-    for (int i = 0; i < NUM_SIZES; ++i) {
-      List* list = new (&_freelist[i]) List();
+    if (HugePages) {
+      MadviseWrapper::huge(_heap, _num_chunks * ChunkSize);
+    }
+
+    if (UseShadow) {
+      // Mapped but untouched, so only the shadow of chunks in use is
+      // ever populated.
+      void* shadow = SourceHeap::malloc(_num_chunks * ChunkSize / SHADOW_GRANULARITY);
+      if (shadow == NULL) {
+        out_of_memory();
+      }
+      _shadow.initialize(_heap, shadow);
+    }
+
+    // One range per node; in huge-page mode, whole groups each.
+    _num_arenas = Numa::nodeCount();
+    if (_num_arenas > MaxNodes) {
+      _num_arenas = MaxNodes;
+    }
+    _arena_slots = _num_chunks / _num_arenas;
+    if (HugePages && _num_arenas > 1) {
+      _arena_slots -= _arena_slots % GROUP_SLOTS;
+    }
+    if (_arena_slots == 0) {
+      _num_arenas = 1;
+      _arena_slots = _num_chunks;
+    }
+
+    for (size_t n = 0; n < _num_arenas; ++n) {
+      Arena& arena = _arenas[n];
+      arena.allocated = n * _arena_slots;
+      arena.end = arena.allocated + _arena_slots;
+      arena.spare_slots = 0;
+      for (int i = 0; i < NUM_SIZES; ++i) {
+        arena.pool[i] = NULL;
+        arena.pool_size[i] = 0;
+        arena.carve[i] = arena.carve_end[i] = NULL;
+        arena.chunks_of_size[i] = 0;
+        arena.started[i] = 0;
+        arena.num_spares[i] = 0;
+      }
+      arena.pending_begin = arena.pending_end = 0;
+      if (_num_arenas > 1) {
+        // Only a preference: a node that runs out borrows memory rather
+        // than failing. If it cannot be set, pages land wherever they
+        // are first touched, which costs locality but nothing else.
+        Numa::bind(_heap + arena.allocated * ChunkSize, _arena_slots * ChunkSize, n);
+      }
     }
   }
 
@@ -40,20 +163,41 @@ class CheckedHeap : public SourceHeap {
   inline void* malloc(size_t sz) {
     assert(sz > 0);
 
+    const size_t requested = sz;
     size_t size_idx = idx_for_size(sz);
     sz = size_for_idx(size_idx);
 
-    List& list = _freelist[size_idx];
-
-    if (list.size() < Quarantine) {
-      allocate_new_chunk(size_idx);
+    // Reuse objects that have served their quarantine, newest first;
+    // failing that, carve fresh ones.
+    Arena& arena = local_arena();
+    lnode* node = arena.pool[size_idx];
+    List& list = arena.quarantine[size_idx];
+    bool fresh = false;
+    if (node != NULL) {
+      arena.pool[size_idx] = node->next;
+      arena.pool_size[size_idx] -= 1;
+      // mark as allocated
+      node->prev = node->next = node;
+    } else if (list.size() > Quarantine) {
+      node = list.dequeue();
+    } else {
+      node = carve(arena, size_idx);
+      fresh = true;
     }
 
-    lnode* node = list.dequeue();
     size_t chunk_idx = idx_for_chunk(node);
     ChunkInfo& chunk = _info[chunk_idx];
     void* ptr = chunk.obj_for_node(node);
     assert((uintptr_t)ptr % Align == 0);
+    if ((ValidateOnMalloc || UseShadow) && !fresh) {
+      canaryCheck(ptr, sz);
+    }
+    if (UseShadow) {
+      _shadow.unpoison(ptr, requested, sz);
+      size_t redzone = sz - requested;
+      memset((uint8_t*)ptr + requested, REDZONE_FILL,
+             redzone < SAMPLE_BYTES ? redzone : (size_t) SAMPLE_BYTES);
+    }
     return ptr;
   }
 
@@ -70,8 +214,24 @@ class CheckedHeap : public SourceHeap {
       unallocated_free(ptr);
     }
 
+    if (UseShadow) {
+      size_t used = _shadow.addressable(ptr, chunk.size());
+      redzoneCheck((uint8_t*)ptr + used, chunk.size() - used);
+    }
+    if (ValidateOnMalloc || UseShadow) {
+      canaryFill(ptr, chunk.size());
+    }
+    if (Colors > 1 && (uint8_t*)ptr + chunk.size() == chunk.slack()) {
+      checkSpan(chunk.slack(), chunk.color(), _canary);
+    }
+    if (UseShadow) {
+      _shadow.poison(ptr, chunk.size(), Shadow::FREED);
+    }
+
+    // Back to the range the object came from, even if it was freed by a
+    // thread on another node.
     lnode* node = chunk.node_for_obj(ptr);
-    quarantine(idx_for_size(chunk.size()), node);
+    quarantine(arena_for_idx(chunk_idx), idx_for_size(chunk.size()), node);
     return true;
   }
 
@@ -92,6 +252,136 @@ class CheckedHeap : public SourceHeap {
     return info.size();
   }
 
+  // Checks that every chunk's color slack holds the canary and, with
+  // UseShadow, every object's shadow against its allocation state: free
+  // objects must be all FREED (or all UNADDRESSABLE, if never used);
+  // live ones must start with an addressable byte and end in a redzone.
+  // Only the shadow is read, never the objects themselves.
+  inline bool validate(void) {
+    if (!UseShadow && Colors == 1) {
+      return true;
+    }
+    size_t slots;
+    for (size_t n = 0; n < _num_arenas; ++n) {
+      for (size_t idx = n * _arena_slots; idx < _arenas[n].allocated; idx += slots) {
+        ChunkInfo& chunk = _info[idx];
+        size_t sz = chunk.size();
+        if (sz == 0) {
+          // Skipped for a huge-page group.
+          slots = 1;
+          continue;
+        }
+        slots = slots_for_idx(idx_for_size(sz));
+        // Spares still being prefaulted have no canary yet.
+        if (idx < _arenas[n].pending_begin || idx >= _arenas[n].pending_end) {
+          checkSpan(chunk.slack(), chunk.color(), _canary);
+        }
+        if (!UseShadow) {
+          continue;
+        }
+        for (size_t i = 0; i < chunk.num_objects(); ++i) {
+          void* obj = chunk.object(i);
+          if (chunk.is_free(obj)) {
+            if (!_shadow.all(obj, sz, Shadow::FREED) &&
+                !_shadow.all(obj, sz, Shadow::UNADDRESSABLE)) {
+              unallocated_access(obj);
+            }
+          } else {
+            // The redzone starts at the granule after the last
+            // addressable byte.
+            size_t used = _shadow.addressable(obj, sz);
+            size_t redzone = (used + SHADOW_GRANULARITY - 1) & ~(SHADOW_GRANULARITY - 1);
+            if (used == 0 ||
+                !_shadow.all((uint8_t*)obj + redzone, sz - redzone, Shadow::UNADDRESSABLE)) {
+              unallocated_access(obj);
+            }
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+  // A chunk set up ahead of demand, not yet handed to its class.
+  struct Spare {
+    size_t arena;
+    size_t size_idx;
+    size_t chunk_idx;
+  };
+
+  // Spare chunks are prepared in three steps, so that page faults happen
+  // without the heap's lock:
+  //   - with the lock held, reserveSpares() sets up to `max` chunks aside
+  //     for the classes that have started chunks since the last call,
+  //     up to MAX_SPARES per class, and as long as an arena's spares
+  //     hold no more than 1/SPARE_SHARE of its unassigned slots;
+  //   - with the lock released, prefault() faults each one in and fills
+  //     its color slack;
+  //   - with the lock held again, publishSpares() hands them over.
+  // Only one thread may be between the first and last step at a time.
+  // @return the number of chunks set aside.
+  size_t reserveSpares(Spare* spares, size_t max) {
+    size_t n = 0;
+    for (size_t a = 0; a < _num_arenas; ++a) {
+      Arena& arena = _arenas[a];
+      // Spares come from the arena's own range, one after another.
+      arena.pending_begin = arena.allocated;
+      for (size_t i = 0; i < NUM_SIZES; ++i) {
+        // Demand since the last call predicts demand until the next.
+        size_t want = arena.started[i] < MAX_SPARES ? arena.started[i] : (size_t) MAX_SPARES;
+        arena.started[i] = 0;
+        size_t slots = slots_for_idx(i);
+        for (size_t have = arena.num_spares[i]; have < want && n < max; ++have) {
+          size_t chunk_idx;
+          if ((arena.spare_slots + slots) * SPARE_SHARE > arena.end - arena.allocated ||
+              !setup_chunk(arena, i, false, chunk_idx)) {
+            break;
+          }
+          arena.spare_slots += slots;
+          spares[n].arena = a;
+          spares[n].size_idx = i;
+          spares[n].chunk_idx = chunk_idx;
+          ++n;
+        }
+      }
+      arena.pending_end = arena.allocated;
+    }
+    return n;
+  }
+
+  // Faults in a chunk set aside by reserveSpares() and fills its color
+  // slack. Its objects have never been used, so where the kernel cannot
+  // populate pages for us, writing zeros over the first byte of each
+  // page does no harm.
+  void prefault(const Spare& spare) {
+    uint8_t* chunk_addr = (uint8_t*)chunk_for_idx(spare.chunk_idx);
+    size_t chunk_bytes = slots_for_idx(spare.size_idx) * ChunkSize - (HugePages ? 0 : GuardSize);
+    if (!MadviseWrapper::populate(chunk_addr, chunk_bytes)) {
+      for (size_t i = 0; i < chunk_bytes; i += HL::CPUInfo::PageSize) {
+        ((volatile uint8_t*)chunk_addr)[i] = 0;
+      }
+    }
+    fillSlack(_info[spare.chunk_idx]);
+  }
+
+  void publishSpares(const Spare* spares, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      Arena& arena = _arenas[spares[i].arena];
+      size_t size_idx = spares[i].size_idx;
+      assert(arena.num_spares[size_idx] < MAX_SPARES);
+      arena.spares[size_idx][arena.num_spares[size_idx]++] = spares[i].chunk_idx;
+    }
+    for (size_t a = 0; a < _num_arenas; ++a) {
+      _arenas[a].pending_begin = _arenas[a].pending_end = 0;
+    }
+  }
+
+  // Sets the function called, with the heap's lock held, each time a
+  // class starts a chunk. It must not allocate.
+  void onSpareDemand(void (*handler)(void)) {
+    _spare_demand = handler;
+  }
+
  private:
   struct lnode {
     struct lnode* prev;
@@ -143,12 +433,15 @@ class CheckedHeap : public SourceHeap {
   
   class ChunkInfo {
    public:
-    ChunkInfo() {}
-    ChunkInfo(size_t size, void* chunk_addr) {
+    ChunkInfo() : _size(0), _num_objects(0), _color(0), _nodes(NULL), _objs(NULL) {}
+    ChunkInfo(size_t size, void* chunk_addr, size_t chunk_bytes, size_t color) {
       _size = size;
+      _color = color;
       _nodes = (lnode*)chunk_addr;
-      _num_objects = ChunkSize / (NodeSize + _size);
-      _objs = (uint8_t*)chunk_addr + (NodeSize * _num_objects);
+      _num_objects = (chunk_bytes - color) / (NodeSize + _size);
+      // Objects end `color` bytes before the chunk does; any other slack
+      // sits after the nodes.
+      _objs = (uint8_t*)chunk_addr + chunk_bytes - color - (_size * _num_objects);
     }
 
     inline bool is_free(void* ptr) {
@@ -159,6 +452,23 @@ class CheckedHeap : public SourceHeap {
     inline size_t size(void) {
       return _size;
     }
+
+    inline size_t num_objects(void) {
+      return _num_objects;
+    }
+
+    inline void* object(size_t idx) {
+      return get_obj(idx);
+    }
+
+    // The `color()` bytes between the last object and the chunk's end.
+    inline uint8_t* slack(void) {
+      return _objs + _size * _num_objects;
+    }
+
+    inline size_t color(void) {
+      return _color;
+    }
     
     inline void* obj_for_node(lnode* node) {
       return get_obj(node_idx(node));
@@ -168,12 +478,8 @@ class CheckedHeap : public SourceHeap {
       return get_node(obj_idx(obj));
     }
 
-    inline void initialize(List* freelist) {
-      for (lnode* node = _nodes;
-           node < (lnode*)_objs;
-           ++node) {
-        freelist->queue(node);
-      }
+    inline lnode* first_node(void) {
+      return _nodes;
     }
 
    private:
@@ -200,14 +506,14 @@ class CheckedHeap : public SourceHeap {
     inline size_t node_idx(lnode* node) {
       uintptr_t node_addr = (uintptr_t)node;
       uintptr_t nodes_addr = (uintptr_t)_nodes;
-      uintptr_t objs_addr = (uintptr_t)_objs;
       assert(node_addr >= nodes_addr);
-      assert(node_addr < objs_addr);
+      assert(node_addr < nodes_addr + (_num_objects * NodeSize));
       return (node_addr - nodes_addr) / NodeSize;
     }
    
     size_t _size;
     size_t _num_objects;
+    size_t _color;
     lnode* _nodes;
     uint8_t* _objs;
   };
@@ -216,33 +522,298 @@ class CheckedHeap : public SourceHeap {
   CheckPowerOfTwo<MinSize> _min_pot;
   CheckPowerOfTwo<MaxSize> _max_pot;
   CheckPowerOfTwo<ChunkSize> _chunk_pot;
+  enum { VerifyGuard = HL::sassert<(GuardSize < ChunkSize)>::VALUE };
+
+  // Every object is at least this aligned, so granules never straddle
+  // two objects.
+  enum { SHADOW_GRANULARITY = (MinSize < 16) ? MinSize : 16 };
+  typedef ShadowMap<SHADOW_GRANULARITY> Shadow;
+
+  enum { CACHE_LINE_SIZE = 64 };
+  enum { VerifyColors = HL::sassert<(Colors > 0 && Colors * CACHE_LINE_SIZE < ChunkSize / 2)>::VALUE };
 
   enum { MIN_LOG = StaticLog<MinSize>::VALUE };
   enum { MAX_LOG = StaticLog<MaxSize>::VALUE };
   enum { MAX_IDX = MAX_LOG - MIN_LOG };
   enum { NUM_SIZES = MAX_IDX + 1 };
 
-  void allocate_new_chunk(size_t size_idx) {
-    if (_allocated >= _num_chunks) {
+  // Medium size classes (too big for a single ChunkSize chunk to hold many
+  // objects) get chunks spanning several consecutive ChunkSize slots,
+  // enough for roughly MIN_CHUNK_OBJECTS objects each.
+  enum { MIN_CHUNK_OBJECTS = 32 };
+
+  // Huge-page mode: groups of HUGE_GROUP_SIZE, the last huge page of
+  // which is a guard. A chunk must fit in what is left.
+  enum { HUGE_PAGE_SIZE = 2 * 1024 * 1024 };
+  enum { HUGE_GROUP_SIZE = 16 * HUGE_PAGE_SIZE };
+  enum { GROUP_SLOTS = HUGE_GROUP_SIZE / ChunkSize };
+  enum { GROUP_USABLE_SLOTS = (HUGE_GROUP_SIZE - HUGE_PAGE_SIZE) / ChunkSize };
+  enum { VerifyHugeGroup = HL::sassert<(!HugePages ||
+                                        (ChunkSize <= HUGE_PAGE_SIZE &&
+                                         MaxSize * MIN_CHUNK_OBJECTS <= HUGE_GROUP_SIZE - HUGE_PAGE_SIZE))>::VALUE };
+
+  enum { VerifyNodes = HL::sassert<(MaxNodes > 0)>::VALUE };
+
+  // The most chunk guards made with mprotect: 16384 mappings, a quarter
+  // of the kernel's default vm.max_map_count.
+  enum { MAX_SPLIT_GUARDS = 8192 };
+
+  // The most objects a class keeps on its pool; enough to cover a burst
+  // of frees and reallocations, few enough that the objects reused from
+  // it are still likely cached.
+  enum { POOL_LIMIT = 64 };
+
+  // The most spare chunks a class keeps ready.
+  enum { MAX_SPARES = 4 };
+
+  // Spares never pin more than this fraction of an arena's unassigned
+  // slots, so that they give way as its range runs low.
+  enum { SPARE_SHARE = 8 };
+
+  // A NUMA node's share of the heap: a range of slots, and everything
+  // that hands out the objects carved from it.
+  struct Arena {
+    // Next unassigned slot, and one past the range's last.
+    size_t allocated;
+    size_t end;
+
+    // Recently freed objects of each size, oldest first.
+    List quarantine[NUM_SIZES];
+
+    // Objects of each size that have left the quarantine, linked through
+    // next, most recent first, and how many there are.
+    lnode* pool[NUM_SIZES];
+    size_t pool_size[NUM_SIZES];
+
+    // Per size, the next never-used node of its newest chunk, and the
+    // end of that chunk's nodes.
+    lnode* carve[NUM_SIZES];
+    lnode* carve_end[NUM_SIZES];
+
+    // Chunks assigned to each size so far, which picks the next color.
+    size_t chunks_of_size[NUM_SIZES];
+
+    // Chunks each size has started since the last reserveSpares().
+    size_t started[NUM_SIZES];
+
+    // Chunks set up and faulted in ahead of demand, by size.
+    size_t spares[NUM_SIZES][MAX_SPARES];
+    size_t num_spares[NUM_SIZES];
+
+    // Slots held by spares, set aside or published.
+    size_t spare_slots;
+
+    // The slots set aside by the last reserveSpares(), until
+    // publishSpares().
+    size_t pending_begin;
+    size_t pending_end;
+  };
+
+  inline Arena& local_arena(void) {
+    if (MaxNodes == 1 || _num_arenas == 1) {
+      return _arenas[0];
+    }
+    return _arenas[Numa::currentNode() % _num_arenas];
+  }
+
+  // @return the arena whose range holds the slot.
+  inline Arena& arena_for_idx(size_t chunk_idx) {
+    assert(chunk_idx < _num_arenas * _arena_slots);
+    return _arenas[chunk_idx / _arena_slots];
+  }
+
+  inline size_t slots_for_idx(size_t size_idx) {
+    size_t bytes = size_for_idx(size_idx) * MIN_CHUNK_OBJECTS;
+    return bytes <= ChunkSize ? 1 : bytes / ChunkSize;
+  }
+
+  void allocate_new_chunk(Arena& arena, size_t size_idx) {
+    size_t chunk_idx = 0;
+    arena.started[size_idx]++;
+    if (arena.num_spares[size_idx] > 0) {
+      chunk_idx = arena.spares[size_idx][--arena.num_spares[size_idx]];
+      arena.spare_slots -= slots_for_idx(size_idx);
+    } else if (setup_chunk(arena, size_idx, true, chunk_idx)) {
+      fillSlack(_info[chunk_idx]);
+    } else {
       out_of_memory();
     }
+    if (_spare_demand != NULL) {
+      _spare_demand();
+    }
+    // Nodes are handed out in order from here; untouched ones are still
+    // zero, which reads as free.
+    ChunkInfo& chunk = _info[chunk_idx];
+    arena.carve[size_idx] = chunk.first_node();
+    arena.carve_end[size_idx] = chunk.first_node() + chunk.num_objects();
+  }
+
+  // Assigns slots from the arena's range (or, if it is full and
+  // `borrow` is set, from any other) to a new chunk of the class, and
+  // sets up its guard and metadata. Its objects and slack are not
+  // touched.
+  // @return false if there is no room.
+  bool setup_chunk(Arena& arena, size_t size_idx, bool borrow, size_t& chunk_idx) {
+    size_t slots = slots_for_idx(size_idx);
+    if (!reserve(arena, slots, chunk_idx)) {
+      size_t n = 0;
+      while (borrow && n < _num_arenas && !reserve(_arenas[n], slots, chunk_idx)) {
+        ++n;
+      }
+      if (!borrow || n == _num_arenas) {
+        return false;
+      }
+    }
     size_t sz = size_for_idx(size_idx);
-    size_t chunk_idx = _allocated;
-    _allocated += 1;
+    uint8_t* chunk_addr = (uint8_t*)chunk_for_idx(chunk_idx);
+    size_t chunk_bytes = slots * ChunkSize - (HugePages ? 0 : GuardSize);
+    if (!HugePages && GuardSize > 0 && takeGuard() &&
+        GuardPages::protect(chunk_addr + chunk_bytes, GuardSize) != 0) {
+      out_of_memory();
+    }
+    size_t color = (arena.chunks_of_size[size_idx]++ % Colors) * CACHE_LINE_SIZE;
     ChunkInfo* chunk =
-      new (&_info[chunk_idx]) ChunkInfo(sz, chunk_for_idx(chunk_idx));
-    chunk->initialize(&_freelist[size_idx]);
+      new (&_info[chunk_idx]) ChunkInfo(sz, chunk_addr, chunk_bytes, color);
+    // Every slot of a multi-slot chunk carries the same metadata, so
+    // ownership stays a single index computation.
+    for (size_t i = 1; i < slots; ++i) {
+      _info[chunk_idx + i] = *chunk;
+    }
+    return true;
+  }
+
+  // Fills the slack between a chunk's last object and its guard with the
+  // canary.
+  inline void fillSlack(ChunkInfo& chunk) {
+    if (chunk.color() > 0) {
+      DieFast::fill(chunk.slack(), chunk.color(), _canary);
+    }
+  }
+
+  // @return true if a new chunk may have a guard.
+  inline bool takeGuard(void) {
+    if (GuardPages::available()) {
+      return true;
+    }
+    if (_split_guards == MAX_SPLIT_GUARDS) {
+      return false;
+    }
+    _split_guards++;
+    return true;
+  }
+
+  // @return the next never-used node of the class, marked allocated.
+  inline lnode* carve(Arena& arena, size_t size_idx) {
+    if (arena.carve[size_idx] == arena.carve_end[size_idx]) {
+      allocate_new_chunk(arena, size_idx);
+    }
+    lnode* node = arena.carve[size_idx]++;
+    node->prev = node->next = node;
+    return node;
+  }
+
+  // Assigns the next `slots` slots of the arena's range to a chunk.
+  // @return false if the range is full.
+  bool reserve(Arena& arena, size_t slots, size_t& chunk_idx) {
+    if (HugePages) {
+      enter_huge_group(arena, slots);
+    }
+    if (arena.allocated + slots > arena.end) {
+      return false;
+    }
+    chunk_idx = arena.allocated;
+    arena.allocated += slots;
+    return true;
+  }
+
+  // Makes room for a chunk of `slots` slots in the arena's current
+  // huge-page group, moving on to the next group if need be. Slots
+  // skipped over, including the guard, keep empty metadata.
+  void enter_huge_group(Arena& arena, size_t slots) {
+    size_t in_group = arena.allocated % GROUP_SLOTS;
+    if (in_group + slots > GROUP_USABLE_SLOTS) {
+      arena.allocated += GROUP_SLOTS - in_group;
+      in_group = 0;
+    }
+    if (in_group == 0 && arena.allocated + GROUP_SLOTS <= arena.end) {
+      uint8_t* guard = _heap + (arena.allocated + GROUP_USABLE_SLOTS) * ChunkSize;
+      if (GuardPages::protect(guard, HUGE_PAGE_SIZE) != 0) {
+        out_of_memory();
+      }
+    }
   }
 
   bool owns(void* ptr) {
     uintptr_t heapaddr = (uintptr_t)_heap;
     uintptr_t addr = (uintptr_t)ptr;
-    return addr >= heapaddr &&
-           addr < (heapaddr + (_allocated * ChunkSize));
+    if (addr < heapaddr) {
+      return false;
+    }
+    size_t idx = (addr - heapaddr) / ChunkSize;
+    return idx < _num_arenas * _arena_slots &&
+           idx < arena_for_idx(idx).allocated &&
+           // Huge-page groups leave slots that belong to no chunk.
+           (!HugePages || _info[idx].size() != 0);
   }
   
-  void quarantine(size_t size_idx, lnode* node) {
-    _freelist[size_idx].queue(node);
+  void quarantine(Arena& arena, size_t size_idx, lnode* node) {
+    List& list = arena.quarantine[size_idx];
+    list.queue(node);
+    if (list.size() > Quarantine && arena.pool_size[size_idx] < POOL_LIMIT) {
+      lnode* oldest = list.dequeue();
+      // Pool nodes keep a null prev, so they still read as free.
+      oldest->prev = NULL;
+      oldest->next = arena.pool[size_idx];
+      arena.pool[size_idx] = oldest;
+      arena.pool_size[size_idx] += 1;
+    }
+  }
+
+  enum { SAMPLE_BYTES = 256 };
+
+  // What the start of a live object's redzone is filled with.
+  enum { REDZONE_FILL = 0xCB };
+
+  inline void canaryFill(void* ptr, size_t sz) {
+    if (sz <= 2 * SAMPLE_BYTES) {
+      DieFast::fill(ptr, sz, _canary);
+      return;
+    }
+    DieFast::fill(ptr, SAMPLE_BYTES, _canary);
+    DieFast::fill((uint8_t*)ptr + sz - SAMPLE_BYTES, SAMPLE_BYTES, _canary);
+  }
+
+  // Only freed objects are ever dequeued, so they all hold the canary.
+  inline void canaryCheck(void* ptr, size_t sz) {
+    if (sz <= 2 * SAMPLE_BYTES) {
+      checkSpan(ptr, sz, _canary);
+      return;
+    }
+    checkSpan(ptr, SAMPLE_BYTES, _canary);
+    checkSpan((uint8_t*)ptr + sz - SAMPLE_BYTES, SAMPLE_BYTES, _canary);
+  }
+
+  inline void redzoneCheck(uint8_t* ptr, size_t sz) {
+    if (sz > SAMPLE_BYTES) {
+      sz = SAMPLE_BYTES;
+    }
+    for (size_t i = 0; i < sz; ++i) {
+      if (ptr[i] != REDZONE_FILL) {
+        unallocated_access(&ptr[i]);
+      }
+    }
+  }
+
+  inline void checkSpan(void* ptr, size_t sz, size_t expected) {
+    if (!DieFast::checkNot(ptr, sz, expected)) {
+      return;
+    }
+    size_t* words = (size_t*)ptr;
+    for (size_t i = 0; i < sz / sizeof(size_t); ++i) {
+      if (words[i] != expected) {
+        unallocated_access(&words[i]);
+      }
+    }
   }
 
   inline ssize_t idx_for_size(size_t sz) {
@@ -258,12 +829,12 @@ class CheckedHeap : public SourceHeap {
     uintptr_t heapaddr = (uintptr_t)_heap;
     uintptr_t addr = (uintptr_t)ptr;
     assert(addr >= heapaddr);
-    assert(addr < (heapaddr + (_allocated * ChunkSize)));
+    assert(addr < (heapaddr + (_num_chunks * ChunkSize)));
     return (addr - heapaddr) / ChunkSize;
   }
 
   inline void* chunk_for_idx(size_t idx) {
-    assert(idx < _allocated);
+    assert(idx < _num_chunks);
     return (void*)&_heap[idx * ChunkSize];
   }
 
@@ -271,20 +842,31 @@ class CheckedHeap : public SourceHeap {
 
   void* _mem; // unaligned memory
 
-  // Chunk metadata; _allocated valid chunks.
+  // Chunk metadata; valid below each arena's allocated slot.
   ChunkInfo _info[MaxChunks + 1];
 
   // Either MaxChunks or MaxChunks - 1; difference due to alignment.
   size_t _num_chunks;
 
-  // number of "allocated" (assigned) chunks.
-  size_t _allocated;
-
-  // Free list for each size
-  List _freelist[NUM_SIZES];
+  // One per NUMA node in use; arena n owns slots
+  // [n * _arena_slots, (n + 1) * _arena_slots).
+  Arena _arenas[MaxNodes];
+  size_t _num_arenas;
+  size_t _arena_slots;
 
   // aligned memory; beginning of chunks.
   uint8_t* _heap;
+
+  // What freed objects are filled with.
+  const size_t _canary;
+
+  // Chunk guards made with mprotect so far.
+  size_t _split_guards;
+
+  // Called each time a class starts a chunk; see onSpareDemand().
+  void (*_spare_demand)(void);
+
+  Shadow _shadow;
 };
 
 #endif
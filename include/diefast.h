@@ -13,8 +13,20 @@ public:
   /// @param sz    the size of the buffer
   /// @param val   the value to check for
   static bool checkNot (void * const ptr, size_t sz, size_t val) {
-    size_t * l = (size_t *) ptr;
-    for (int i = 0; i < (int) (sz / sizeof(size_t)); i++) {
+    const size_t * l = (const size_t *) ptr;
+    const size_t n = sz / sizeof(size_t);
+    size_t i = 0;
+    // Mismatches are OR-ed together a block at a time, with no branch
+    // per word, so that the inner loop vectorizes.
+    for (; i + CHECK_BLOCK <= n; i += CHECK_BLOCK) {
+      size_t diff = 0;
+      for (size_t j = 0; j < CHECK_BLOCK; j++) {
+	diff |= l[i + j] ^ val;
+      }
+      if (diff != 0)
+	return true;
+    }
+    for (; i < n; i++) {
       if (l[i] != val)
 	return true;
     }
@@ -38,6 +50,10 @@ public:
 
   }
 
+private:
+
+  enum { CHECK_BLOCK = 8 };
+
 };
 
 #endif
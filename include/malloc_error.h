@@ -18,6 +18,13 @@ void unallocated_access(void* ptr) {
   abort();
 }
 
+void underflow_write(void* ptr) __attribute__((noreturn));
+void underflow_write(void* ptr) {
+  fprintf(stderr, "Modified memory at %p, before the start of an object.\n", ptr);
+  fflush(stderr);
+  abort();
+}
+
 void out_of_memory(void) __attribute__((noreturn));
 void out_of_memory(void) {
   fprintf(stderr, "Out of memory.\n");
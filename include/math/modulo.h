@@ -12,7 +12,7 @@
 
 // Use a fast modulus function if possible.
 
-template <int B>
+template <size_t B>
 inline size_t modulo (size_t v) {
   sassert<(B > 0)> modulus_must_be_positive;
   modulus_must_be_positive = modulus_must_be_positive;
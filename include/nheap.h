@@ -17,15 +17,20 @@ template <class    RegionHeap,
           size_t   AllocSize,
           size_t   GuardSize,
           size_t   QuarantineSize,
-          bool     ValidateOnMalloc>
+          bool     ValidateOnMalloc,
+          bool     LazyCanary = false>
 class NHeap : RegionHeap {
  public:
   NHeap() : _canary(RealRandomValue::value()),
             _heap(static_cast<uint8_t*>(RegionHeap::malloc(HeapSize))) {
     assert(_heap != NULL && "Region allocator failed to allocated more memory.");
 
-    // Initialize the entire heap to freed.
-    canaryFill(reinterpret_cast<CanaryType*>(_heap), HeapSize / CANARY_SIZE);
+    // Initialize the entire heap to freed. In lazy mode, freshly mapped
+    // memory is all zeros, and zero serves as the canary for every object
+    // that has never been handed out; see _canaried.
+    if (!LazyCanary) {
+      canaryFill(reinterpret_cast<CanaryType*>(_heap), HeapSize / CANARY_SIZE);
+    }
     for (uint32_t i = 0; i < NUM_OBJECTS; ++i) {
       uint32_t tmp;
       bool status = _free.queue(i, &tmp);
@@ -33,6 +38,7 @@ class NHeap : RegionHeap {
     }
     _free_bitmap.clear();
     _quarantine_bitmap.clear();
+    _canaried.clear();
   }
 
   ~NHeap() {
@@ -81,8 +87,10 @@ class NHeap : RegionHeap {
       unallocated_free(ptr);
     }
 
-    // Canary the allocated memory.
+    // Canary the allocated memory. The guard was filled by pre_alloc,
+    // so the whole object now holds the real canary.
     canaryFill(reinterpret_cast<CanaryType*>(ptr), ALLOC_CANARIES);
+    _canaried.tryToSet(idx);
 
     // Add it to the quarantine, possibly permanently freeing an older
     // object.
@@ -127,9 +135,11 @@ class NHeap : RegionHeap {
       checkObject(idx);
     }
 
-    // And the last canaries.
+    // And the last canaries, which lazy mode never writes.
     size_t offset = NUM_OBJECTS * OBJECT_CANARIES;
-    canaryCheck(reinterpret_cast<CanaryType*>(_heap) + offset, HEAP_CANARIES - offset);
+    canaryCheck(reinterpret_cast<CanaryType*>(_heap) + offset,
+                HEAP_CANARIES - offset,
+                LazyCanary ? 0 : _canary);
   }
 
   inline bool can_allocate(void) {
@@ -168,18 +178,28 @@ class NHeap : RegionHeap {
   }
 
   // checks for `len` canaries of length sizeof(CanaryType) at `buf`.
-  inline void canaryCheck(CanaryType* buf, size_t len) {
+  inline void canaryCheck(CanaryType* buf, size_t len, CanaryType canary) {
     for (size_t i = 0; i < len; ++i) {
-      if (buf[i] == _canary) {
+      if (buf[i] == canary) {
         continue;
       }
-      unallocated_access(reinterpret_cast<void*>(buf + len));
+      unallocated_access(reinterpret_cast<void*>(buf + i));
     }
   }
 
+  // Objects that have never been freed still hold the zeros they were
+  // mapped with (lazy mode only).
+  inline CanaryType expectedCanary(size_t i) {
+    if (LazyCanary && !_canaried.isSet(i)) {
+      return 0;
+    }
+    return _canary;
+  }
+
   inline void checkObject(size_t i) {
     canaryCheck(static_cast<CanaryType*>(getObject(i)),
-                OBJECT_CANARIES);
+                OBJECT_CANARIES,
+                expectedCanary(i));
   }
 
   inline void canaryFill(CanaryType* buf, size_t len) {
@@ -192,6 +212,11 @@ class NHeap : RegionHeap {
     if (ValidateOnMalloc) {
       checkObject(i);
     }
+    if (LazyCanary && !_canaried.isSet(i)) {
+      // First use: the guard in front of the object gets its real canary
+      // now; the rest is written when the object is freed.
+      canaryFill(static_cast<CanaryType*>(getGuard(i)), GUARD_CANARIES);
+    }
     _quarantine_bitmap.reset(i);
     _free_bitmap.tryToSet(i);
     return getAlloc(i);
@@ -215,6 +240,10 @@ class NHeap : RegionHeap {
   StaticBitMap<NUM_OBJECTS> _free_bitmap;
   StaticBitMap<NUM_OBJECTS> _quarantine_bitmap;
 
+  // Objects whose memory holds _canary rather than the zeros it was mapped
+  // with. Only consulted in lazy mode.
+  StaticBitMap<NUM_OBJECTS> _canaried;
+
   uint8_t* _heap;
 };
 
@@ -19,21 +19,16 @@ using namespace HL;
 #include <mmapalloc.h>
 #include <rng/randomnumbergenerator.h>
 #include <static/staticlog.h>
+#include <static/staticswitch.h>
 #include <util/bitmap.h>
 
-template <int Numerator, int Denominator>
-class RandomHeapBase {
-public:
-
-  virtual ~RandomHeapBase (void) {}
-
-  virtual void * malloc (size_t) = 0;
-  virtual bool free (void *) = 0;
-  virtual size_t getSize (void *) const = 0;
-  virtual void validate() = 0;
-  virtual bool register_access(void*) = 0;
-  virtual void reset_access() = 0;
-};
+// When set, getObject() picks a miniheap with probability proportional
+// to its free objects, so its first probe always finds room. Otherwise
+// it picks one by capacity and probes again whenever that one is full,
+// as it used to; bench/probes.cpp builds both to compare them.
+#ifndef PICK_BY_FREE_OBJECTS
+#define PICK_BY_FREE_OBJECTS 1
+#endif
 
 template <int Numerator,
           int Denominator,
@@ -44,7 +39,7 @@ template <int Numerator,
               unsigned long ObjectSize2,
               unsigned long NObjects,
               class Allocator> class MiniHeap>
-class RandomCheckedHeap : public RandomHeapBase<Numerator, Denominator> {
+class RandomCheckedHeap {
 
   /// The most miniheaps we will use without overflowing.
   /// We will support at most 2GB per size class.
@@ -70,7 +65,6 @@ public:
       _available (0UL),
       _inUse (0UL),
       _miniHeapsInUse (0),
-      _chunksInUse (0),
       _check2 ((size_t) CHECK2)
   {
     Check<RandomCheckedHeap *> sanity (this);
@@ -92,11 +86,13 @@ public:
     // Fill the buffer with miniheaps. NB: the first two have the
     // same number of objects -- this simplifies the math for
     // selecting heaps.
-    ::new ((char *) _buf)
-	MiniHeapType<MIN_OBJECTS> ();
-    StaticForLoop<1, MAX_MINIHEAPS-1, Initializer, char *>::run ((char *) _buf);
+    StaticForLoop<0, MAX_MINIHEAPS, Initializer, MiniHeapSlot *>::run (_miniHeaps);
 
     _accessMap.clear();
+
+    for (int i = 0; i < MAX_MINIHEAPS; i++) {
+      _inUseOf[i] = 0;
+    }
   }
 
 
@@ -124,9 +120,9 @@ public:
   // MUST be reentrant. NO allocation or I/O.
   inline bool register_access(void* ptr) {
     for (unsigned int i = 0; i < _miniHeapsInUse; ++i) {
-      if (getMiniHeap(i)->inBounds(ptr)) {
+      if (dispatch<InBounds, bool> (i, Call (this, ptr))) {
         if (_accessMap.tryToSet(i)) {
-          getMiniHeap(i)->unprotect();
+          dispatch<Unprotect, void> (i, Call (this));
         }
         return true;
       }
@@ -141,9 +137,10 @@ public:
     // If we find it, return true.
     for (int i = _miniHeapsInUse - 1; i >= 0; i--) {
       
-      if (getMiniHeap(i)->free (ptr)) {
+      if (dispatch<Free, bool> (i, Call (this, ptr))) {
         // Found it -- drop the amount of space in use.
         _inUse--;
+        _inUseOf[i]--;
         return true;
       }
     }
@@ -154,8 +151,8 @@ public:
 
   /// @return the space available from this point in the given object
   /// @note returns 0 if this object is not managed by this heap
-  inline size_t getSize (void * ptr) const {
-    Check<const RandomCheckedHeap *> sanity (this);
+  inline size_t getSize (void * ptr) {
+    Check<RandomCheckedHeap *> sanity (this);
 
     // We start from the largest heap (most objects) and work our way
     // down to improve performance in the common case.
@@ -163,7 +160,7 @@ public:
     int v = _miniHeapsInUse;
 
     for (int i = v - 1; i >= 0; i--) {
-      size_t sz = getMiniHeap(i)->getSize (ptr);
+      size_t sz = dispatch<GetSize, size_t> (i, Call (this, ptr));
       if (sz != 0) {
         // Found it.
         return sz;
@@ -180,7 +177,7 @@ public:
   inline void validate() {
     for (size_t i = 0; i < _miniHeapsInUse; ++i) {
       if (_accessMap.isSet(i)) {
-        getMiniHeap(i)->validate();
+        dispatch<Validate, void> (i, Call (this));
       }
     }
   }
@@ -188,7 +185,7 @@ public:
   inline void reset_access() {
     for (unsigned int i = 0; i < _miniHeapsInUse; ++i) {
       if (_accessMap.reset(i)) {
-        getMiniHeap(i)->protect();
+        dispatch<Protect, void> (i, Call (this));
       }
     }
   }
@@ -200,22 +197,56 @@ private:
   RandomCheckedHeap& operator= (const RandomCheckedHeap&);
 
   // Pick a random heap, and get an object from it.
+  //
+  // Every free object of this size is equally likely to be returned:
+  // a heap is picked with probability proportional to the number of
+  // objects free in it, and then picks uniformly among those. Picking
+  // heaps by capacity and retrying on collisions (PICK_BY_FREE_OBJECTS
+  // 0) gives the same distribution, but spends probes on full heaps.
 
   inline void * getObject (size_t sz) {
     void * ptr = NULL;
     while (!ptr) {
-      size_t rnd = _random.next();
-      // NB: _chunksInUse acts as a bitmask that eliminates the need for
-      // an (expensive) modulus operation on _available -- the
-      // expression is the same as "v = rnd % _available".
-      size_t v      = rnd & _chunksInUse;
-      // Compute the index as a log of v (+1 to avoid log2(0)).
-      unsigned int index  = log2(v + 1);
-      ptr = getMiniHeap(index)->malloc (sz);
+#if PICK_BY_FREE_OBJECTS
+      // (high bits * n) >> 32 is uniform in [0, n) to within 2^-32,
+      // without a division.
+      const size_t nfree = _available - _inUse;
+      size_t r = (size_t) (((_random.next() >> 32) * nfree) >> 32);
+      // Start from the largest heap, which usually has half the free
+      // objects.
+      int index = _miniHeapsInUse - 1;
+      while (r >= freeObjects (index)) {
+        r -= freeObjects (index);
+        index--;
+        assert (index >= 0);
+      }
+#else
+      // Capacity is a power of two times MIN_OBJECTS, so the mask is
+      // the same as "v = rnd % chunks". log2 rounds up, so heap i gets
+      // 2^(i-1) of the chunks (heap 0 gets one), in proportion to its
+      // capacity.
+      const size_t chunks = _available / MIN_OBJECTS;
+      size_t v = _random.next() & (chunks - 1);
+      int index = log2 (v + 1);
+#endif
+      ptr = dispatch<Malloc, void *> (index, Call (this, NULL, sz));
+      if (ptr != NULL) {
+        _inUseOf[index]++;
+      }
     }
     return ptr;
   }
 
+  /// @return the number of objects the given mini heap holds.
+  static inline size_t capacity (unsigned int index) {
+    return (index == 0) ? (size_t) MIN_OBJECTS : ((size_t) MIN_OBJECTS << (index - 1));
+  }
+
+  /// @return the number of free objects in the given mini heap.
+  inline size_t freeObjects (unsigned int index) const {
+    return capacity (index) - _inUseOf[index];
+  }
+
   // The allocator for the mini heaps.
 
   template <size_t Value, class SuperHeap>
@@ -237,50 +268,126 @@ private:
   template <unsigned long Number> class MiniHeapType
     : public MiniHeap<Numerator, Denominator, ObjectSize, Number, TheAllocator> {};
 
-  // The size of a mini heap.
-  enum { MINIHEAP_SIZE = sizeof(MiniHeapType<MIN_OBJECTS>) };
+  // Room for one mini heap. The size and alignment of a mini heap do
+  // not depend on its number of objects (see the constructor).
+  struct MiniHeapSlot {
+    alignas (MiniHeapType<MIN_OBJECTS>) char bytes[sizeof (MiniHeapType<MIN_OBJECTS>)];
+  };
+
+  // The type of the mini heap with the given index, which holds
+  // capacity(Index) objects.
+  template <int Index>
+  class MiniHeapAt {
+  public:
+    typedef MiniHeapType<(Index == 0)
+			 ? (unsigned long) MIN_OBJECTS
+			 : (unsigned long) MIN_OBJECTS * ((1UL << Index) >> 1)> Type;
+  };
 
   // An initializer, used by StaticForLoop, to instantiate a mini heap.
   template <int Index>
   class Initializer {
   public:
-    static void run (char * buf) {
-      ::new (buf + MINIHEAP_SIZE * Index)
-      MiniHeapType<(MIN_OBJECTS * (1UL << (Index - 1)))>;
+    static void run (MiniHeapSlot * slots) {
+      typedef typename MiniHeapAt<Index>::Type Type;
+      sassert<(sizeof(Type) <= sizeof(MiniHeapSlot)) &&
+              (alignof(MiniHeapSlot) % alignof(Type) == 0)> verifyFitsSlot;
+      verifyFitsSlot = verifyFitsSlot;
+      ::new (slots[Index].bytes) Type;
     }
   };
 
 
   /// @return the desired mini-heap.
-  inline typename MiniHeapType<MIN_OBJECTS>::SuperHeap * getMiniHeap (unsigned int index) const {
-    Check<const RandomCheckedHeap *> sanity (this);
+  template <int Index>
+  inline typename MiniHeapAt<Index>::Type * getMiniHeap (void) {
+    Check<RandomCheckedHeap *> sanity (this);
+    assert (Index <= (int) _miniHeapsInUse);
+    return reinterpret_cast<typename MiniHeapAt<Index>::Type *> (_miniHeaps[Index].bytes);
+  }
+
+  // Calls on the mini heaps go through dispatch(), which switches on
+  // the index to the right MiniHeapAt type, so they can be inlined.
+
+  /// The heap and arguments of a call to one of its mini heaps.
+  class Call {
+  public:
+    Call (RandomCheckedHeap * h, void * p = NULL, size_t s = 0)
+      : heap (h), ptr (p), sz (s) {}
+    RandomCheckedHeap * heap;
+    void * ptr;
+    size_t sz;
+  };
+
+  /// @return the result of Op on the mini heap with the given index.
+  template <template <int> class Op, typename R>
+  static inline R dispatch (unsigned int index, Call c) {
     assert (index < MAX_MINIHEAPS);
-    assert (index <= _miniHeapsInUse);
-    return (typename MiniHeapType<MIN_OBJECTS>::SuperHeap *) &_buf[index * MINIHEAP_SIZE];
+    return StaticSwitch<0, MAX_MINIHEAPS, Op, R, Call>::run (index, c);
   }
 
+  template <int Index>
+  class Malloc {
+  public:
+    static void * run (Call c) { return c.heap->template getMiniHeap<Index>()->malloc (c.sz); }
+  };
+
+  template <int Index>
+  class Free {
+  public:
+    static bool run (Call c) { return c.heap->template getMiniHeap<Index>()->free (c.ptr); }
+  };
+
+  template <int Index>
+  class GetSize {
+  public:
+    static size_t run (Call c) { return c.heap->template getMiniHeap<Index>()->getSize (c.ptr); }
+  };
+
+  template <int Index>
+  class InBounds {
+  public:
+    static bool run (Call c) { return c.heap->template getMiniHeap<Index>()->inBounds (c.ptr); }
+  };
+
+  template <int Index>
+  class Activate {
+  public:
+    static void run (Call c) { c.heap->template getMiniHeap<Index>()->activate(); }
+  };
+
+  template <int Index>
+  class Validate {
+  public:
+    static void run (Call c) { c.heap->template getMiniHeap<Index>()->validate(); }
+  };
+
+  template <int Index>
+  class Protect {
+  public:
+    static void run (Call c) { c.heap->template getMiniHeap<Index>()->protect(); }
+  };
+
+  template <int Index>
+  class Unprotect {
+  public:
+    static void run (Call c) { c.heap->template getMiniHeap<Index>()->unprotect(); }
+  };
+
 
   // Activate another mini heap to satisfy the current memory requests.
   NO_INLINE void getAnotherMiniHeap (void) {
     Check<RandomCheckedHeap *> sanity (this);
     if (_miniHeapsInUse < MAX_MINIHEAPS) {
       // Update the amount of available space.
-      if( _miniHeapsInUse == 0) {
-        _available += MIN_OBJECTS;
-      } else {
-        _available += (1 << (_miniHeapsInUse-1)) * MIN_OBJECTS;
-      }
+      _available += capacity (_miniHeapsInUse);
       // Activate the new mini heap.
-      getMiniHeap(_miniHeapsInUse)->activate();
+      dispatch<Activate, void> (_miniHeapsInUse, Call (this));
       // protect it to trigger initial access registration.
-      getMiniHeap(_miniHeapsInUse)->protect();
+      dispatch<Protect, void> (_miniHeapsInUse, Call (this));
       // Update the number of mini heaps in use (one more).
       _miniHeapsInUse++;
-      // Update the number of chunks in use (multiples of MIN_OBJECTS) minus 1.
-      _chunksInUse = (1 << (_miniHeapsInUse - 1)) - 1;
-      assert ((unsigned long) ((_chunksInUse + 1) * MIN_OBJECTS) == _available);
-      // Verifies that it is indeed, a power of two minus 1.
-      assert (((_chunksInUse + 1) & _chunksInUse) == 0);
+      assert (((size_t) MIN_OBJECTS << (_miniHeapsInUse - 1)) == _available);
     }
     check();
   }
@@ -299,11 +406,11 @@ private:
   /// The number of "mini-heaps" currently in use.
   unsigned int _miniHeapsInUse;
 
-  /// The number of "chunks" in use (multiples of MIN_OBJECTS) minus 1.
-  unsigned int _chunksInUse;
+  /// The number of objects allocated from each mini heap.
+  size_t _inUseOf[MAX_MINIHEAPS];
 
-  /// The buffer that holds the various mini heaps.
-  char _buf[sizeof(MiniHeapType<MIN_OBJECTS>) * MAX_MINIHEAPS];
+  /// The storage that holds the various mini heaps.
+  MiniHeapSlot _miniHeaps[MAX_MINIHEAPS];
 
   size_t _check2;
 
@@ -7,6 +7,14 @@
 #include <cstdio>
 #include <cstdlib>
 
+// When set, activating a miniheap does not canary-fill it. Freshly
+// mapped memory is all zeros, and an object that has never been freed
+// is checked against zero instead of _freedValue; its real canary is
+// written the first time it is freed.
+#ifndef LAZY_CANARY_FILL
+#define LAZY_CANARY_FILL 1
+#endif
+
 const uint32_t canary = 0xBABECAFE;
 
 static void register_missing_canary(void* l) {
@@ -21,8 +29,9 @@ static void register_missing_canary(void* l) {
 static void* checkWhereNot(void* const ptr,
                              size_t sz,
                              size_t val) {
-  size_t* l = (size_t*)ptr;
-  for (l = (size_t*)ptr; l < (l + sz); ++l) {
+  size_t* const end = (size_t*)((char*)ptr + sz);
+  size_t* l;
+  for (l = (size_t*)ptr; l < end; ++l) {
     if (*l != val) {
       return (void*)l;
     }
@@ -36,9 +45,17 @@ template <int Numerator,
 	  unsigned long NObjects,
 	  class Allocator>
 class RandomMiniCheckedHeap :
-  public RandomMiniHeapCore<Numerator, Denominator, ObjectSize, NObjects, Allocator> {
+  public RandomMiniHeapCore<Numerator, Denominator, ObjectSize, NObjects, Allocator,
+                            RandomMiniCheckedHeap<Numerator, Denominator, ObjectSize, NObjects, Allocator> > {
  public:
 
+  typedef RandomMiniHeapCore<Numerator, Denominator, ObjectSize, NObjects, Allocator,
+                             RandomMiniCheckedHeap> SuperHeap;
+
+  // The core lays out objects through getObject and computeIndex.
+  friend class RandomMiniHeapCore<Numerator, Denominator, ObjectSize, NObjects, Allocator,
+                                  RandomMiniCheckedHeap>;
+
   /// @return the space remaining from this point in this object
   /// @nb Returns zero if this object is not managed by this heap.
   inline size_t getSize (void * ptr) {
@@ -59,14 +76,18 @@ class RandomMiniCheckedHeap :
   void* malloc(size_t sz) {
     void* ptr = SuperHeap::malloc(sz);
     if (ptr == NULL) return NULL;
-    ptrdiff_t index = (static_cast<char*>(ptr) - _miniHeap) / ObjectSize;
-    validate_object(index);
+    // The object is already marked in use, so check it as the free
+    // object it was a moment ago.
+    check_canary(computeIndex(ptr));
     return ptr;
   }
 
   bool free (void * ptr) {
     if (SuperHeap::free(ptr)) {
       DieFast::fill (ptr, ObjectSize, SuperHeap::_freedValue);
+#if LAZY_CANARY_FILL
+      _canaried.tryToSet (computeIndex (ptr));
+#endif
       return true;
     }
     return false;
@@ -88,30 +109,7 @@ class RandomMiniCheckedHeap :
     assert(status == 0 && "failed to mprotect memory.");
   }
 
-  typedef RandomMiniHeapCore<Numerator, Denominator, ObjectSize, NObjects, Allocator> SuperHeap;
-
-  /// @return true iff the index is valid for this heap.
-  bool inBounds (void * ptr) const {
-    if ((ptr < _miniHeap) || (ptr >= _miniHeap + NObjects * ObjectSize)
-	|| (_miniHeap == NULL)) {
-      return false;
-    } else {
-      return true;
-    }
-  }
-
-protected:
-
-  void validate_object(size_t i) {
-    void* ptr;
-    if (!SuperHeap::_miniHeapBitmap.isSet(i) &&
-        (ptr = checkWhereNot(getObject(i),
-                             ObjectSize,
-                             SuperHeap::_freedValue)) != NULL) {
-      register_missing_canary(ptr);
-    }
-  }
-
+  /// @brief Activates the heap, making it ready for allocations.
   void activate() {
     if (!SuperHeap::_isHeapActivated) {
 
@@ -123,8 +121,16 @@ protected:
         MadviseWrapper::random (_miniHeap, NObjects * ObjectSize);
         // Activate the bitmap.
         SuperHeap::_miniHeapBitmap.reserve (NObjects);
+#if USE_SHUFFLE_VECTOR
+        SuperHeap::reserveFreeIndices();
+#endif
+#if LAZY_CANARY_FILL
+        // Leave the pages untouched; see expectedCanary().
+        _canaried.reserve (NObjects);
+#else
         // Fill the empty space.
         DieFast::fill (_miniHeap, NObjects * ObjectSize, SuperHeap::_freedValue);
+#endif
       } else {
         assert (0);
       }
@@ -132,8 +138,44 @@ protected:
     }
   }
 
+  /// @return true iff the index is valid for this heap.
+  bool inBounds (void * ptr) const {
+    if ((ptr < _miniHeap) || (ptr >= _miniHeap + NObjects * ObjectSize)
+	|| (_miniHeap == NULL)) {
+      return false;
+    } else {
+      return true;
+    }
+  }
+
+protected:
 
-  unsigned int computeIndex (void * ptr) const {
+  void validate_object(size_t i) {
+    if (!SuperHeap::_miniHeapBitmap.isSet(i)) {
+      check_canary(i);
+    }
+  }
+
+  /// Reports the object at index i unless it holds its canary.
+  void check_canary(size_t i) {
+    void* ptr = checkWhereNot(getObject(i), ObjectSize, expectedCanary(i));
+    if (ptr != NULL) {
+      register_missing_canary(ptr);
+    }
+  }
+
+  /// @return the value a free object at index i must be filled with.
+  inline size_t expectedCanary(size_t i) const {
+#if LAZY_CANARY_FILL
+    if (!_canaried.isSet(i)) {
+      // Never freed, so still the zeros it was mapped with.
+      return 0;
+    }
+#endif
+    return SuperHeap::_freedValue;
+  }
+
+  size_t computeIndex (void * ptr) const {
     size_t offset = computeOffset (ptr);
     if (IsPowerOfTwo<ObjectSize>::VALUE) {
       return (offset >> StaticLog<ObjectSize>::VALUE);
@@ -148,7 +190,7 @@ protected:
     return offset;
   }
 
-  void * getObject (unsigned int index) {
+  void * getObject (size_t index) {
     assert ((unsigned long) index < NObjects);
 
     if (!SuperHeap::_isHeapActivated) {
@@ -160,6 +202,11 @@ protected:
 
   /// The heap pointer.
   char * _miniHeap;
+
+#if LAZY_CANARY_FILL
+  /// Objects that have been freed at least once, and so hold _freedValue.
+  BitMap<Allocator> _canaried;
+#endif
 };
 
 
@@ -3,21 +3,19 @@
 #ifndef RANDOMMINIHEAP_CORE
 #define RANDOMMINIHEAP_CORE
 
-#include <util/bitmap.h>
-
-class RandomMiniHeapBase {
-public:
+#include <stdint.h>
 
-  virtual void * malloc (size_t) = 0;
-  virtual bool free (void *) = 0;
-  virtual size_t getSize (void *) = 0;
-  virtual void activate (void) = 0;
-  virtual void validate (void) = 0;
-  virtual void protect(void) = 0;
-  virtual void unprotect(void) = 0;
-  virtual ~RandomMiniHeapBase () {}
-};
+#include <util/bitmap.h>
 
+// When set, each miniheap keeps the indices of its free objects in a
+// vector and malloc takes a uniformly random entry of it, moving the
+// last entry into its place, so malloc succeeds in one step whenever
+// the miniheap is not full. Otherwise malloc probes one random bitmap
+// bit and returns NULL if it is taken. The vector costs four bytes per
+// object.
+#ifndef USE_SHUFFLE_VECTOR
+#define USE_SHUFFLE_VECTOR 1
+#endif
 
 /**
  * @class RandomMiniHeapCore
@@ -27,6 +25,9 @@ public:
  * @param ObjectSize the object size managed by this heap.
  * @param NObjects the number of objects in this heap.
  * @param Allocator the source heap for allocations.
+ * @param Derived the class deriving from this one, which lays out the
+ *        objects: it provides inBounds, getSize, getObject and
+ *        computeIndex, called without virtual dispatch.
  * @sa    RandomHeap
  * @author Emery Berger <http://www.cs.umass.edu/~emery>
  **/
@@ -34,14 +35,13 @@ template <int Numerator,
 	  int Denominator,
 	  unsigned long ObjectSize,
 	  unsigned long NObjects,
-	  class Allocator>
-class RandomMiniHeapCore : public RandomMiniHeapBase {
+	  class Allocator,
+	  class Derived>
+class RandomMiniHeapCore {
 public:
 
   /// Check values for sanity checking.
   enum { CHECK1 = 0xEEDDCCBB, CHECK2 = 0xBADA0101 };
-  
-  typedef RandomMiniHeapBase SuperHeap;
 
   // Note: we force the lowest bit to 1 make the _freedValue an invalid
   // pointer value for many architectures.
@@ -50,10 +50,21 @@ public:
     : _check1 ((size_t) CHECK1),
       _freedValue (_random.next() | 1), 
       _isHeapActivated (false),
+#if USE_SHUFFLE_VECTOR
+      _freeIndices (NULL),
+      _numFree (0),
+#endif
       _check2 ((size_t) CHECK2)
   {
     Check<RandomMiniHeapCore *> sanity (this);
 
+#if USE_SHUFFLE_VECTOR
+    // Entries hold an index plus one, in a FreeIndex, which also bounds
+    // the size_t indices stored in them.
+    sassert<(NObjects < (unsigned long) (FreeIndex) ~0)> verifyIndicesFit;
+    verifyIndicesFit = verifyIndicesFit;
+#endif
+
     // NOTE: Not clear if this is strictly required but it is
     // invariably true.
     CheckPowerOfTwo<CPUInfo::PageSize> invariant2;
@@ -64,7 +75,8 @@ public:
 
   /// @return an allocated object of size ObjectSize
   /// @param sz   requested object size
-  /// @note May return NULL even though there is free space.
+  /// @note May return NULL even though there is free space, unless
+  ///       USE_SHUFFLE_VECTOR is set.
   void * malloc (size_t sz)
   {
     Check<RandomMiniHeapCore *> sanity (this);
@@ -74,25 +86,43 @@ public:
 
     void * ptr = NULL;
 
+#if USE_SHUFFLE_VECTOR
+    if (_numFree == 0) {
+      return NULL;
+    }
+
+    // Take a random free index; the last one fills its place.
+    // (high bits * _numFree) >> 32 is uniform in [0, _numFree) to
+    // within 2^-32, without a division.
+    size_t r = (size_t) (((_random.next() >> 32) * _numFree) >> 32);
+    size_t index = freeIndexAt (r);
+    size_t last = freeIndexAt (_numFree - 1);
+    _numFree--;
+    setFreeIndexAt (r, last);
+
+    bool didMalloc = _miniHeapBitmap.tryToSet (index);
+    assert (didMalloc);
+#else
     // Try to allocate an object from the bitmap.
-    unsigned int index = modulo<NObjects> (_random.next());
+    size_t index = modulo<NObjects> (_random.next());
 
     bool didMalloc = _miniHeapBitmap.tryToSet (index);
 
     if (!didMalloc) {
       return NULL;
     }
+#endif
 
     // Get the address of the indexed object.
-    ptr = getObject (index);
+    ptr = derived().getObject (index);
 
 #ifndef NDEBUG
-    unsigned int computedIndex = computeIndex (ptr);
+    size_t computedIndex = derived().computeIndex (ptr);
     assert (index == computedIndex);
 #endif
     
     // Make sure the returned object is the right size.
-    assert (getSize(ptr) == ObjectSize);
+    assert (derived().getSize(ptr) == ObjectSize);
 
     return ptr;
   }
@@ -104,11 +134,11 @@ public:
     Check<RandomMiniHeapCore *> sanity (this);
 
     // Return false if the pointer is out of range.
-    if (!inBounds(ptr)) {
+    if (!derived().inBounds(ptr)) {
       return false;
     }
 
-    unsigned int index = computeIndex (ptr);
+    size_t index = derived().computeIndex (ptr);
     assert (((unsigned long) index < NObjects));
 
     bool didFree = true;
@@ -116,6 +146,10 @@ public:
     // Reset the appropriate bit in the bitmap.
     if (_miniHeapBitmap.reset (index)) {
       // We actually reset the bit, so this was not a double free.
+#if USE_SHUFFLE_VECTOR
+      setFreeIndexAt (_numFree, index);
+      _numFree++;
+#endif
     } else {
       //      reportDoubleFreeError();
       didFree = false;
@@ -130,33 +164,45 @@ public:
 	    (_check2 == CHECK2));
   }
 
-  virtual void validate(void) {
-  }
-
-  /// @brief Activates the heap, making it ready for allocations.
-  virtual void activate() = 0;
-  
-  /// @return true iff the index is valid for this heap.
-  virtual bool inBounds (void * ptr) const = 0;
-
 protected:
 
   // Disable copying and assignment.
   RandomMiniHeapCore (const RandomMiniHeapCore&);
   RandomMiniHeapCore& operator= (const RandomMiniHeapCore&);
 
-  /// @return The address of the object corresponding to this index in the bitmap.
-  virtual void * getObject (unsigned int index) = 0;
-
-  /// @return the index corresponding to the given object.
-  virtual unsigned int computeIndex (void * ptr) const = 0;
-
+  inline Derived& derived (void) {
+    return static_cast<Derived&>(*this);
+  }
 
   /// @return true iff heap is currently active.
   inline bool isActivated (void) const {
     return _isHeapActivated;
   }
 
+#if USE_SHUFFLE_VECTOR
+  /// Sets up the free-index vector when the heap is activated. Freshly
+  /// mapped memory is all zeros, which reads as every object free (see
+  /// freeIndexAt()), so none of it is touched here.
+  void reserveFreeIndices (void) {
+    _freeIndices = (FreeIndex *) Allocator::malloc (NObjects * sizeof(FreeIndex));
+    assert (_freeIndices != NULL);
+    _numFree = NObjects;
+  }
+
+  /// @return the free index stored at position i of the vector, where
+  /// zero stands for i itself.
+  inline size_t freeIndexAt (size_t i) const {
+    assert (i < _numFree);
+    FreeIndex v = _freeIndices[i];
+    return (v == 0) ? i : v - 1;
+  }
+
+  inline void setFreeIndexAt (size_t i, size_t index) {
+    assert (i < NObjects);
+    _freeIndices[i] = (FreeIndex) (index + 1);
+  }
+#endif
+
   /// A struct that is exactly the size of objects from this heap,
   /// making it convenient for pointer math.
   typedef struct {
@@ -179,6 +225,18 @@ protected:
   /// The bitmap for this heap.
   BitMap<Allocator> _miniHeapBitmap;
 
+#if USE_SHUFFLE_VECTOR
+  /// A free-index vector entry. Four bytes, not a size_t, to halve the
+  /// vector; a miniheap with 2^32 - 1 or more objects fails to compile
+  /// (see the constructor) and needs USE_SHUFFLE_VECTOR 0.
+  typedef uint32_t FreeIndex;
+
+  /// The indices of the free objects, in no particular order, in the
+  /// first _numFree entries.
+  FreeIndex * _freeIndices;
+  size_t _numFree;
+#endif
+
   /// Sanity check value.
   const size_t _check2;
 
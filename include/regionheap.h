@@ -10,47 +10,116 @@
 
 #include <malloc_error.h>
 #include <static/staticlog.h>
+#include <util/guardpages.h>
+#include <util/madvisewrapper.h>
+#include <util/platformspecific.h>
 
 // an dl-malloc style allocator
 // with guard pages around every allocation.
+// Run headers are kept in a side table indexed by page number, so the
+// only syscall per malloc or free is the one that flips the user pages.
+// Pages are guarded with GuardPages, which avoids splitting the heap's
+// mapping where the kernel supports it and uses mprotect otherwise.
+// Guards cost page tables, so the part of the heap never handed out --
+// everything above a frontier that only moves up -- is kept PROT_NONE
+// instead, one mapping with no page tables at all.
+//
+// Freed runs are not re-protected right away. Up to DeferredFrees of them
+// wait, still readable and writable, in a small cache. Without a
+// quarantine, a malloc of exactly the same number of pages reuses a
+// cached run with no syscall at all. When the cache fills, the whole
+// batch is protected at once, merging adjacent runs into a single call,
+// and only then quarantined, or coalesced and binned. The cache is also
+// flushed once its oldest run has waited through DeferredFrees mallocs
+// and frees, so freed memory stays accessible for at most DeferredFrees
+// subsequent calls of either kind, even if nothing more is ever freed.
+// DeferredFrees = 0 protects on every free.
+//
+// Freed pages are discarded as they are protected, so they cost no
+// physical memory. Once protected, a run may additionally sit in a
+// quarantine; only once it leaves can its range be reused, and until
+// then use-after-free accesses fault. The quarantine is a FIFO per
+// power-of-two size bucket, each holding up to
+// QuarantineBytes / QUARANTINE_BUCKETS of address space and always at
+// least its newest run, so a huge free cannot push small runs out. The
+// quarantine is only drained early when a malloc would otherwise fail.
+//
+// With RightAlign, each object ends flush against its run's guard page,
+// so the first byte written past it faults. The slack in front of it is
+// filled with a canary that free() checks, which catches underflows.
+//
+// With DeferCoalescing, released runs of up to NUM_FAST_BINS pages are
+// not coalesced but pushed onto exact-size fast bins, as in dlmalloc,
+// and a malloc of the same size pops them straight back off. They are
+// only merged with their neighbors when a malloc cannot otherwise be
+// satisfied.
+// This only pays off for runs that small, freed and allocated again
+// in quick succession, so with no quarantine (or a short one) in front.
 template <class SourceHeap,
           size_t Scale /* for scale * AddrBits bins, approximately */,
           size_t PageSize,
-          size_t HeapSize /* in bytes, not pages */>
+          size_t HeapSize /* in bytes, not pages */,
+          size_t DeferredFrees = 8,
+          size_t QuarantineBytes = 0,
+          bool RightAlign = false,
+          bool DeferCoalescing = false>
 class ProtectedPageAllocator : SourceHeap {
  public:
-  enum { Alignment = PageSize };
-
-  ProtectedPageAllocator() {
-    _heap = static_cast<Page*>(SourceHeap::malloc(HeapSize));
+  // Right-aligned objects are only as aligned as malloc must make them.
+  enum { ObjectAlignment = 16 };
+  enum { Alignment = RightAlign ? (size_t) ObjectAlignment : PageSize };
+
+  ProtectedPageAllocator()
+    : _frontier(0),
+      _num_fast(0),
+      _num_deferred(0),
+      _deferred_age(0),
+      _quarantined_bytes(0)
+  {
+    // The whole heap starts above the frontier, inaccessible. Reserved
+    // PROT_NONE and unaccounted, it is address space only, so even hosts
+    // with less memory than HeapSize can map it.
+    _heap = static_cast<Page*>(reserve(HeapSize, PROT_NONE));
     // initialize bins.
     for (int i = 0; i < NUM_BINS_TOTAL; ++i) {
       Bin* bin = new (&_bins[i]) Bin;
     }
+    memset(_binmap, 0, sizeof(_binmap));
+    memset(_fast, 0, sizeof(_fast));
 
     // round up to the nearest page
     uintptr_t heap_addr = reinterpret_cast<size_t>(_heap);
     size_t excess = heap_addr % PageSize;
-    size_t cut = PageSize - excess;
+    size_t cut = 0;
     if (excess > 0) {
+      cut = PageSize - excess;
       heap_addr += cut;
       _heap = reinterpret_cast<Page*>(heap_addr);
     }
     _size = (HeapSize - cut) / PageSize;
 
-    // mprotect the whole heap to PROT_NONE by default.
-    mprotect_or_die(static_cast<void*>(_heap + 1), PageSize * (_size - 1), PROT_NONE);
-  
+    // Run metadata lives out of band, one header per page, so touching
+    // it never requires changing the protection of the heap itself.
+    // Only the header of the first page of a run is meaningful; all
+    // others have chunks == 0.
+    _headers = static_cast<ObjectHeader*>(reserve(sizeof(ObjectHeader) * _size,
+                                                  PROT_READ | PROT_WRITE));
+
     // Initialize bins by "allocating" our exact free space.
-    _heap->obj.free = true;
-    _heap->obj.chunks = _size - 1;
-    _heap->obj.next = _heap->obj.prev = NULL;
-    rebin(&(_heap->obj));
+    ObjectHeader* obj = &_headers[0];
+    obj->free = true;
+    obj->deferred = false;
+    obj->quarantined = false;
+    obj->fast = false;
+    obj->chunks = _size;
+    obj->next = obj->prev = NULL;
+    rebin(obj);
   }
 
   ~ProtectedPageAllocator() {}
 
   inline bool handle_write(void* ptr) {
+    return false;
   }
 
   inline void print(void) {
@@ -58,12 +127,15 @@ class ProtectedPageAllocator : SourceHeap {
     printf("Size of %zu pages (%zu bytes).\n", _size, _size * PageSize);
     printf("offset = %d\n", POWER_OFFSET);
     printf("numTotalBins = %d\n", NUM_BINS_TOTAL);
+    printf("guards: %s, %zu mappings in process.\n",
+           GuardPages::available() ? "madvise" : "mprotect",
+           GuardPages::mappingCount());
     for (size_t i = 0; i < NUM_BINS_TOTAL; ++i) {
       size_t num = 0;
       ObjectHeader* obj = _bins[i].head;
       while (obj != NULL) {
         num += 1;
-        obj = obj->next;
+        obj = obj->bin_next;
       }
       if (num == 0) continue;
 
@@ -78,70 +150,61 @@ class ProtectedPageAllocator : SourceHeap {
   }
 
   inline void* malloc(size_t sz) {
+    size_t bytes = (sz + (ObjectAlignment - 1)) & -ObjectAlignment;
+
     // Raise sz to the nearest page.
     sz = ((sz + (PageSize - 1)) & -PageSize) / PageSize;
     assert(sz > 0);
 
-    // Now start at its natural bin and go upwards until we find a bin.
-    Page* chunk = NULL;
-    size_t bin;
-    for (bin = binForSize(sz); bin < NUM_BINS_TOTAL; ++bin) {
-      if (_bins[bin].head != NULL) {
-        chunk = reinterpret_cast<Page*>(_bins[bin].head);
-        break;
-      }
+    // Every run carries a trailing guard page that is never unprotected.
+    size_t chunks = sz + 1;
+
+    // A recently freed run of exactly this size is still unprotected.
+    ObjectHeader* obj = takeDeferred(chunks);
+    ageDeferred();
+    if (obj != NULL) {
+      obj->deferred = false;
+      return place(obj, bytes);
+    }
+
+    obj = takeFast(chunks);
+    if (obj != NULL) {
+      unprotect_or_die(static_cast<void*>(pageFor(obj)), sz * PageSize);
+      return place(obj, bytes);
     }
 
-    if (!chunk) {
+    obj = findRun(chunks);
+    if (obj == NULL && _num_deferred > 0) {
+      // The cache may be holding the memory we need.
+      flushDeferred();
+      obj = findRun(chunks);
+    }
+    if (obj == NULL && _num_fast > 0) {
+      consolidate();
+      obj = findRun(chunks);
+    }
+    if (obj == NULL && _quarantined_bytes > 0) {
+      // Last resort: cut the quarantine short rather than fail.
+      drainQuarantine();
+      consolidate();
+      obj = findRun(chunks);
+    }
+
+    if (!obj) {
       // Out of memory.
       return NULL;
     }
 
-    assert(chunk->obj.free && "Found allocated chunk in bin.");
-    assert(chunk->obj.chunks >= sz);
-
-    ObjectHeader::unprotect(&(chunk->obj));
-    _bins[bin].unlink(&(chunk->obj));
+    assert(obj->free && "Found allocated chunk in bin.");
+    assert(obj->chunks >= chunks);
 
-    chunk->obj.free = false;
-    size_t excess = chunk->obj.chunks - sz;
+    unbin(obj);
 
-    if (excess > 0) {
-      Page* page = chunk + (sz + 1);
-      ObjectHeader::unprotect(&(page->obj));
-      page->obj.free = true;
-      page->obj.chunks = excess - 1;
-      page->obj.prev = &(chunk->obj);
-      page->obj.next = chunk->obj.next;
-      if (page->obj.next != NULL) {
-        // do we need to rightward coalesce?
-        ObjectHeader::unprotect(page->obj.next);
-        if (page->obj.next->free) {
-          Page* next = reinterpret_cast<Page*>(page->obj.next);
-          next->obj.unlink();
-          page->obj.chunks += next->obj.chunks + 1;
-          page->obj.next = next->obj.next;
-          if (page->obj.next != NULL) {
-            ObjectHeader::unprotect(page->obj.next);
-            page->obj.next->prev = &(page->obj);
-            ObjectHeader::protect(page->obj.next);
-          }
-        } else {
-          page->obj.next->prev = &(page->obj);
-        }
-        ObjectHeader::protect(page->obj.next);
-      }
-      rebin(&(page->obj));
-      chunk->obj.next = &(page->obj);
-      ObjectHeader::protect(&(page->obj));
-    }
+    obj->free = false;
+    split(obj, chunks);
 
-    void* allocated = static_cast<void*>(chunk + 1);
-    chunk->obj.chunks = sz;
-    assert(chunk->obj.chunks > 0);
-    ObjectHeader::protect(&(chunk->obj));
-    mprotect_or_die(allocated, sz * PageSize, PROT_READ | PROT_WRITE);
-    return allocated;
+    unprotect_or_die(static_cast<void*>(pageFor(obj)), sz * PageSize);
+    return place(obj, bytes);
   }
 
   inline bool free(void* ptr) {
@@ -149,47 +212,27 @@ class ProtectedPageAllocator : SourceHeap {
       return false;
     }
 
-    Page* chunk = static_cast<Page*>(ptr) - 1;
+    ObjectHeader* obj = headerFor(ptr);
 
-    if (chunk->obj.free) {
+    if (!isAllocated(obj) || objectFor(obj) != ptr) {
       unallocated_free(ptr);
     }
 
-    ObjectHeader::unprotect(&(chunk->obj));
-    chunk->obj.free = true;
-
-    if (chunk->obj.prev != NULL &&
-        chunk->obj.prev->free) {
-      size_t sz = chunk->obj.chunks;
-      Page* p_chunk = reinterpret_cast<Page*>(chunk->obj.prev);
-      p_chunk->obj.unlink();
-      p_chunk->obj.chunks += chunk->obj.chunks + 1;
-      p_chunk->obj.next = chunk->obj.next;
-      chunk = p_chunk;
-      if (chunk->obj.next != NULL) {
-        ObjectHeader::unprotect(chunk->obj.next);
-        chunk->obj.next->prev = &(chunk->obj);
-        ObjectHeader::protect(chunk->obj.next);
-      }
+    if (RightAlign) {
+      checkSlack(obj);
     }
 
-    if (chunk->obj.next != NULL &&
-        chunk->obj.next->free) {
-      Page* n_chunk = reinterpret_cast<Page*>(chunk->obj.next);
-      n_chunk->obj.unlink();
-      chunk->obj.chunks += n_chunk->obj.chunks + 1;
-      chunk->obj.next = n_chunk->obj.next;
-      if (chunk->obj.next != NULL) {
-        ObjectHeader::unprotect(chunk->obj.next);
-        chunk->obj.next->prev = &(chunk->obj);
-        ObjectHeader::protect(chunk->obj.next);
-      }
+    if (DeferredFrees == 0) {
+      // The trailing guard page is already protected.
+      retire_or_die(static_cast<void*>(pageFor(obj)), (obj->chunks - 1) * PageSize);
+      quarantine(obj);
+      return true;
     }
 
-    rebin(&(chunk->obj));
-    ObjectHeader::protect(&(chunk->obj));
-    mprotect_or_die(static_cast<void*>(chunk + 1), chunk->obj.chunks * PageSize, PROT_NONE);
-
+    ageDeferred();
+    assert(_num_deferred < DeferredFrees);
+    obj->deferred = true;
+    _deferred[_num_deferred++] = obj;
     return true;
   }
 
@@ -198,55 +241,64 @@ class ProtectedPageAllocator : SourceHeap {
       return 0;
     }
 
-    Page* page = static_cast<Page*>(ptr) - 1;
+    ObjectHeader* obj = headerFor(ptr);
 
-    if (page->obj.free) {
+    if (!isAllocated(obj) || objectFor(obj) != ptr) {
       return 0;
     }
-    assert(page->obj.chunks > 0);
-    return page->obj.chunks * PageSize;
+    assert(obj->chunks > 1);
+    return RightAlign ? obj->bytes : (obj->chunks - 1) * PageSize;
+  }
+
+  // @return true iff ptr lies within this heap's reserved range.
+  inline bool owns(void* ptr) const {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    uintptr_t heap = reinterpret_cast<uintptr_t>(_heap);
+    return addr >= heap && addr - heap < _size * PageSize;
   }
 
   inline bool validate() {
     bool verbose = false;
-    Page* node = _heap;
+    ObjectHeader* node = _headers;
     size_t free = 0;
+    size_t fast = 0;
     size_t allocated = 0;
     size_t total_size = 0;
-    Page* prev = NULL;
+    ObjectHeader* prev = NULL;
     while (true) {
-      if (node->obj.free &&
-          node->obj.chunks > 0) {
+      assert(node->chunks > 0);
+      if (node->free) {
         free += 1;
+      } else if (node->fast) {
+        fast += 1;
       } else {
         allocated += 1;
       }
-      total_size += node->obj.chunks + 1;
-      assert(node->obj.prev == &(prev->obj)); 
-      if (node->obj.next == NULL) {
+      total_size += node->chunks;
+      assert(node->prev == prev);
+      if (node->next == NULL) {
         break;
       } else {
-        ptrdiff_t delta = (char*)node->obj.next - (char*)node;
-        assert(delta > 0);
-        assert((size_t)delta % PageSize == 0);
-        size_t num = (node->obj.chunks + 1) * PageSize;
-        assert((size_t)delta == num);
+        assert(node->next == node + node->chunks);
       }
       prev = node;
-      node = reinterpret_cast<Page*>(node->obj.next);
+      node = node->next;
     }
     if (verbose)
       printf("_size: %zu, total_size: %zu.\n", _size, total_size);
     assert(_size == total_size);
+    assert(fast == _num_fast);
 
     // free in bins:
     size_t bin_total = 0;
     for (size_t i = 0; i < NUM_BINS_TOTAL; ++i) {
       ObjectHeader* obj = _bins[i].head;
       while (obj != NULL) {
+        assert(obj->bin == &_bins[i]);
         obj = obj->bin_next;
         bin_total += 1;
       }
+      assert(_bins[i].empty() == (firstNonEmptyBin(i) != i));
     }
     if (verbose) {
       printf("bin_total: %zu, free: %zu\n", bin_total, free);
@@ -264,30 +316,16 @@ class ProtectedPageAllocator : SourceHeap {
 
   struct ObjectHeader {
     bool free;
+    bool deferred; // freed, but still in the deferred cache.
+    bool quarantined; // freed and protected, but not yet reusable.
+    bool fast; // released, but waiting uncoalesced in a fast bin.
     size_t chunks; // what is actually allocated.
+    size_t bytes; // the object's size, when right-aligned.
     ObjectHeader* prev;
     ObjectHeader* next;
     ObjectHeader* bin_prev;
     ObjectHeader* bin_next;
     Bin*          bin;
-
-    inline void unlink(void) {
-      if (bin != NULL)
-        bin->unlink(this);
-    }
-
-    // static so it may be called on NULL objects.
-    static inline void unprotect(ObjectHeader* obj) {
-      if (obj != NULL) {
-        mprotect_or_die(static_cast<void*>(obj), PageSize, PROT_READ | PROT_WRITE);
-      }
-    }
-
-    static inline void protect(ObjectHeader* obj) {
-      if (obj != NULL) {
-        mprotect_or_die(static_cast<void*>(obj), PageSize, PROT_READ | PROT_WRITE);
-      }
-    }
   };
 
   struct Bin {
@@ -297,7 +335,6 @@ class ProtectedPageAllocator : SourceHeap {
     ObjectHeader* head;
     ObjectHeader* tail;
 
-    // this, obj, obj->bin_prev, and obj->bin_next must be unprotected.
     inline void unlink(ObjectHeader* obj) {
       if (obj->bin_prev == NULL) {
         head = obj->bin_next;
@@ -325,11 +362,23 @@ class ProtectedPageAllocator : SourceHeap {
       }
       obj->bin = this;
     }
+
+    inline ObjectHeader* firstFit(size_t chunks) {
+      for (ObjectHeader* obj = head; obj != NULL; obj = obj->bin_next) {
+        if (obj->chunks >= chunks) {
+          return obj;
+        }
+      }
+      return NULL;
+    }
+
+    inline bool empty(void) const {
+      return head == NULL;
+    }
   };
 
-  union Page {
+  struct Page {
     uint8_t mem[PageSize];
-    ObjectHeader obj;
   };
 
   enum { NUM_FIRST_BINS = 8 };
@@ -337,17 +386,89 @@ class ProtectedPageAllocator : SourceHeap {
   enum { SCALE_BITS = StaticLog<Scale>::VALUE };
   enum { POWER_OFFSET = StaticLog<NUM_FIRST_BINS>::VALUE - 1 };
   enum { NUM_BINS_TOTAL = (ADDR_BITS - POWER_OFFSET) * Scale };
+  enum { WORD_BITS = sizeof(size_t) * 8 };
+  enum { BINMAP_WORDS = (NUM_BINS_TOTAL + WORD_BITS - 1) / WORD_BITS };
 
-  static inline void mprotect_or_die(void* ptr, size_t len, int prot) {
-    int status = mprotect(ptr, len, prot);
+  // Runs of up to this many pages, guard included, get fast bins.
+  enum { NUM_FAST_BINS = 64 };
+
+  // The frontier advances by at least this many pages at a time.
+  enum { FRONTIER_PAGES = 512 };
+
+  // Quarantined runs are kept apart in this many size buckets: 1 page,
+  // 2-3, 4-7, and so on, up to 128MB and more in the last.
+  enum { QUARANTINE_BUCKETS = 16 };
+
+  // Runs of one size bucket waiting to be released, oldest first, and
+  // the bytes of address space they hold.
+  struct Quarantine {
+    Quarantine(void) : head(NULL), tail(NULL), bytes(0) {}
+    ObjectHeader* head;
+    ObjectHeader* tail;
+    size_t bytes;
+  };
+
+  // @return a fresh private mapping of `len` bytes that is not charged
+  // against the commit limit; its pages cost memory only once touched.
+  // Dies if it cannot be mapped.
+  static void* reserve(size_t len, int prot) {
+    void* ptr = mmap(NULL, len, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+      die_on_error("mmap", NULL, len, errno);
+    }
+    return ptr;
+  }
+
+  static inline void protect_or_die(void* ptr, size_t len) {
+    die_on_error("protect", ptr, len, GuardPages::protect(ptr, len));
+  }
+
+  // Protects pages whose contents are dead, returning them to the OS
+  // first. Installing a guard already discards them.
+  static inline void retire_or_die(void* ptr, size_t len) {
+    if (!GuardPages::available()) {
+      MadviseWrapper::discard(ptr, len);
+    }
+    protect_or_die(ptr, len);
+  }
+
+  inline void unprotect_or_die(void* ptr, size_t len) {
+    Page* end = static_cast<Page*>(ptr) + len / PageSize;
+    if (GuardPages::available() && end > _heap + _frontier) {
+      advanceFrontier(end);
+    }
+    die_on_error("unprotect", ptr, len, GuardPages::unprotect(ptr, len));
+  }
+
+  // Moves the frontier up to at least `end`, FRONTIER_PAGES at a time:
+  // the pages it passes become part of the readable and writable mapping
+  // below it, but guarded, so nothing about them changes for the caller.
+  NO_INLINE void advanceFrontier(Page* end) {
+    size_t target = end - _heap;
+    if (target < _frontier + FRONTIER_PAGES) {
+      target = _frontier + FRONTIER_PAGES;
+    }
+    if (target > _size) {
+      target = _size;
+    }
+    void* from = static_cast<void*>(_heap + _frontier);
+    size_t len = (target - _frontier) * PageSize;
+    if (mprotect(from, len, PROT_READ | PROT_WRITE) != 0) {
+      die_on_error("mprotect", from, len, errno);
+    }
+    protect_or_die(from, len);
+    _frontier = target;
+  }
+
+  static inline void die_on_error(const char* op, void* ptr, size_t len, int status) {
     if (status != 0) {
       fprintf(stderr,
-              "mprotect(%p, %zu, %d) failed with error %d: %s\n",
+              "%s(%p, %zu) failed with error %d: %s\n",
+              op,
               ptr,
               len,
-              prot,
-              errno,
-              strerror(errno));
+              status,
+              strerror(status));
       fflush(stderr);
       abort();
     }
@@ -370,17 +491,72 @@ class ProtectedPageAllocator : SourceHeap {
   inline bool sanity_check(void* ptr) {
     // cheap ways to find bad pointers.
     uintptr_t ptr_num = reinterpret_cast<uintptr_t>(ptr);
-    if (ptr_num % PageSize != 0) {
+    if (ptr_num % Alignment != 0) {
       return false;
     }
 
     if (ptr < _heap
-        || ptr_num - reinterpret_cast<uintptr_t>(_heap) > _size * PageSize) {
+        || ptr_num - reinterpret_cast<uintptr_t>(_heap) >= _size * PageSize) {
       return false;
     }
     return true;
   }
 
+  static inline bool isAllocated(ObjectHeader* obj) {
+    return obj->chunks > 0 && !obj->free && !obj->deferred && !obj->quarantined
+      && !obj->fast;
+  }
+
+  inline ObjectHeader* headerFor(void* ptr) {
+    return &_headers[static_cast<Page*>(ptr) - _heap];
+  }
+
+  inline Page* pageFor(ObjectHeader* obj) {
+    return _heap + (obj - _headers);
+  }
+
+  // @return where the object in an allocated run starts.
+  inline void* objectFor(ObjectHeader* obj) {
+    uint8_t* page = pageFor(obj)->mem;
+    if (!RightAlign) {
+      return page;
+    }
+    return page + (obj->chunks - 1) * PageSize - obj->bytes;
+  }
+
+  enum { SLACK_CANARY = 0xA5 };
+
+  // Hands out a run for an object of `bytes` bytes.
+  inline void* place(ObjectHeader* obj, size_t bytes) {
+    obj->bytes = bytes;
+    void* ptr = objectFor(obj);
+    if (RightAlign) {
+      uint8_t* page = pageFor(obj)->mem;
+      memset(page, SLACK_CANARY, static_cast<uint8_t*>(ptr) - page);
+    }
+    return ptr;
+  }
+
+  // Reports the highest byte of a right-aligned object's slack that was
+  // overwritten, if any.
+  inline void checkSlack(ObjectHeader* obj) {
+    const uint8_t* page = pageFor(obj)->mem;
+    const uint8_t* end = static_cast<uint8_t*>(objectFor(obj));
+    // The slack is a whole number of ObjectAlignment units, so check it
+    // a word at a time, nearest the object first.
+    const size_t pattern = ~static_cast<size_t>(0) / 0xFF * SLACK_CANARY;
+    for (size_t i = end - page; i >= sizeof(size_t); i -= sizeof(size_t)) {
+      const uint8_t* w = page + i - sizeof(size_t);
+      if (*reinterpret_cast<const size_t*>(w) != pattern) {
+        for (size_t j = sizeof(size_t); j > 0; --j) {
+          if (w[j - 1] != SLACK_CANARY) {
+            underflow_write(const_cast<uint8_t*>(w + j - 1));
+          }
+        }
+      }
+    }
+  }
+
 
   static inline size_t binSize(size_t bin) {
     if (bin < NUM_FIRST_BINS) {
@@ -421,26 +597,309 @@ class ProtectedPageAllocator : SourceHeap {
     return result;
   }
 
+  // Cuts an allocated run down to `chunks` pages. The remainder, which
+  // must already be protected, becomes a free run.
+  inline void split(ObjectHeader* obj, size_t chunks) {
+    size_t excess = obj->chunks - chunks;
+    if (excess == 0) {
+      return;
+    }
+    ObjectHeader* rest = obj + chunks;
+    rest->free = false;
+    rest->deferred = false;
+    rest->quarantined = false;
+    rest->fast = false;
+    rest->chunks = excess;
+    rest->prev = obj;
+    rest->next = obj->next;
+    if (rest->next != NULL) {
+      rest->next->prev = rest;
+    }
+    obj->next = rest;
+    obj->chunks = chunks;
+    // Coalesces rightward only, since obj is allocated.
+    coalesce(rest);
+  }
+
+  inline ObjectHeader* findRun(size_t chunks) {
+    // Every run in a bin above our natural bin is large enough, and so
+    // is every run in the natural bin itself when we asked for exactly
+    // its lower bound. Take the first non-empty such bin from the bitmap.
+    size_t bin = binForSize(chunks);
+    size_t fit = (binSize(bin) == chunks) ? bin : bin + 1;
+    size_t found = firstNonEmptyBin(fit);
+    if (found < NUM_BINS_TOTAL) {
+      return _bins[found].head;
+    } else if (fit != bin) {
+      // Nothing larger is left; the natural bin may still hold a run
+      // that is big enough.
+      return _bins[bin].firstFit(chunks);
+    }
+    return NULL;
+  }
+
+  // Makes an already-protected run reusable: onto its fast bin if it
+  // has one, otherwise coalesced and binned.
+  inline void release(ObjectHeader* obj) {
+    if (DeferCoalescing && obj->chunks <= NUM_FAST_BINS) {
+      obj->deferred = false;
+      obj->quarantined = false;
+      obj->fast = true;
+      obj->bin_next = _fast[obj->chunks - 1];
+      _fast[obj->chunks - 1] = obj;
+      _num_fast += 1;
+      return;
+    }
+    coalesce(obj);
+  }
+
+  // @return a run of exactly `chunks` pages from the fast bins, or NULL.
+  inline ObjectHeader* takeFast(size_t chunks) {
+    if (!DeferCoalescing || chunks > NUM_FAST_BINS) {
+      return NULL;
+    }
+    ObjectHeader* obj = _fast[chunks - 1];
+    if (obj != NULL) {
+      _fast[chunks - 1] = obj->bin_next;
+      _num_fast -= 1;
+      obj->fast = false;
+    }
+    return obj;
+  }
+
+  // Empties the fast bins, coalescing every run in them.
+  NO_INLINE void consolidate(void) {
+    for (size_t i = 0; _num_fast > 0 && i < NUM_FAST_BINS; ++i) {
+      while (_fast[i] != NULL) {
+        ObjectHeader* obj = _fast[i];
+        _fast[i] = obj->bin_next;
+        _num_fast -= 1;
+        coalesce(obj);
+      }
+    }
+  }
+
+  // Marks an already-protected run free, coalesces it with its free
+  // neighbors and bins the result.
+  inline void coalesce(ObjectHeader* obj) {
+    obj->free = true;
+    obj->deferred = false;
+    obj->quarantined = false;
+    obj->fast = false;
+
+    if (obj->prev != NULL &&
+        obj->prev->free) {
+      ObjectHeader* prev = obj->prev;
+      unbin(prev);
+      prev->chunks += obj->chunks;
+      prev->next = obj->next;
+      obj->chunks = 0;
+      obj = prev;
+      if (obj->next != NULL) {
+        obj->next->prev = obj;
+      }
+    }
+
+    if (obj->next != NULL &&
+        obj->next->free) {
+      ObjectHeader* next = obj->next;
+      unbin(next);
+      obj->chunks += next->chunks;
+      obj->next = next->next;
+      next->chunks = 0;
+      if (obj->next != NULL) {
+        obj->next->prev = obj;
+      }
+    }
+
+    rebin(obj);
+  }
+
+  // @return a deferred run of exactly `chunks` pages, removed from the
+  // cache, or NULL. With a quarantine, deferred runs are never reused
+  // directly: they must serve their time in it first.
+  inline ObjectHeader* takeDeferred(size_t chunks) {
+    if (QuarantineBytes > 0) {
+      return NULL;
+    }
+    for (size_t i = 0; i < _num_deferred; ++i) {
+      ObjectHeader* obj = _deferred[i];
+      if (obj->chunks == chunks) {
+        _num_deferred -= 1;
+        _deferred[i] = _deferred[_num_deferred];
+        return obj;
+      }
+    }
+    return NULL;
+  }
+
+  // Counts a malloc or free against the deferred cache, flushing it once
+  // its oldest run has waited through DeferredFrees of them. Each free
+  // counts, so the cache never holds more than DeferredFrees runs.
+  inline void ageDeferred(void) {
+    if (_num_deferred == 0) {
+      _deferred_age = 0;
+    } else if (++_deferred_age >= DeferredFrees) {
+      flushDeferred();
+    }
+  }
+
+  // Protects every deferred run, then releases them. Runs that are
+  // adjacent in memory (separated only by a guard page, which is already
+  // protected) share a single call.
+  NO_INLINE void flushDeferred(void) {
+    // Insertion sort by address; there are at most DeferredFrees entries.
+    for (size_t i = 1; i < _num_deferred; ++i) {
+      ObjectHeader* obj = _deferred[i];
+      size_t j = i;
+      for (; j > 0 && _deferred[j - 1] > obj; --j) {
+        _deferred[j] = _deferred[j - 1];
+      }
+      _deferred[j] = obj;
+    }
+
+    size_t i = 0;
+    while (i < _num_deferred) {
+      ObjectHeader* first = _deferred[i];
+      ObjectHeader* last = first;
+      while (i + 1 < _num_deferred && _deferred[i + 1] == last + last->chunks) {
+        i += 1;
+        last = _deferred[i];
+      }
+      size_t pages = (last - first) + (last->chunks - 1);
+      retire_or_die(static_cast<void*>(pageFor(first)), pages * PageSize);
+      i += 1;
+    }
+
+    for (i = 0; i < _num_deferred; ++i) {
+      _deferred[i]->deferred = false;
+      quarantine(_deferred[i]);
+    }
+    _num_deferred = 0;
+    _deferred_age = 0;
+  }
+
+  // Holds an already-protected run back from reuse, releasing the oldest
+  // runs of its size bucket once the bucket exceeds its budget.
+  // Quarantined runs are not binned, so the FIFOs are threaded through
+  // their bin links.
+  inline void quarantine(ObjectHeader* obj) {
+    if (QuarantineBytes == 0) {
+      release(obj);
+      return;
+    }
+    Quarantine& q = _quarantine[quarantineBucket(obj->chunks)];
+    obj->quarantined = true;
+    obj->bin_next = NULL;
+    obj->bin_prev = q.tail;
+    if (q.tail != NULL) {
+      q.tail->bin_next = obj;
+    } else {
+      q.head = obj;
+    }
+    q.tail = obj;
+    q.bytes += (obj->chunks - 1) * PageSize;
+    _quarantined_bytes += (obj->chunks - 1) * PageSize;
+
+    while (q.bytes > QuarantineBytes / QUARANTINE_BUCKETS && q.head != obj) {
+      release(dequarantine(q));
+    }
+  }
+
+  // @return the bucket for runs of `chunks` pages, guard included: one
+  // per power of two of their usable pages, the last taking the rest.
+  static inline size_t quarantineBucket(size_t chunks) {
+    size_t bucket = ilog2(chunks - 1);
+    return (bucket < QUARANTINE_BUCKETS) ? bucket : QUARANTINE_BUCKETS - 1;
+  }
+
+  // @return the oldest run of the bucket, removed from the quarantine.
+  inline ObjectHeader* dequarantine(Quarantine& q) {
+    ObjectHeader* oldest = q.head;
+    assert(oldest != NULL && oldest->quarantined);
+    q.head = oldest->bin_next;
+    if (q.head != NULL) {
+      q.head->bin_prev = NULL;
+    } else {
+      q.tail = NULL;
+    }
+    q.bytes -= (oldest->chunks - 1) * PageSize;
+    _quarantined_bytes -= (oldest->chunks - 1) * PageSize;
+    return oldest;
+  }
+
+  NO_INLINE void drainQuarantine(void) {
+    for (size_t i = 0; i < QUARANTINE_BUCKETS; ++i) {
+      while (_quarantine[i].head != NULL) {
+        release(dequarantine(_quarantine[i]));
+      }
+    }
+  }
+
   inline void rebin(ObjectHeader* obj) {
     assert(obj->free && "attempted to rebin an allocated object.");
-    // we use this point to mprotect away obj.
-    Page* page = reinterpret_cast<Page*>(obj) + 1;
-    mprotect_or_die(static_cast<void*>(page), PageSize * obj->chunks, PROT_NONE);
-    if (obj->chunks > 0) {
-      size_t bin_idx = binForSize(obj->chunks);
-      assert(bin_idx < NUM_BINS_TOTAL);
-      _bins[bin_idx].append(obj);
-    } else {
-      obj->bin_prev = obj->bin_next = NULL;
-      obj->bin = NULL;
+    assert(obj->chunks > 0);
+    size_t bin_idx = binForSize(obj->chunks);
+    assert(bin_idx < NUM_BINS_TOTAL);
+    _bins[bin_idx].append(obj);
+    _binmap[bin_idx / WORD_BITS] |= static_cast<size_t>(1) << (bin_idx % WORD_BITS);
+  }
+
+  inline void unbin(ObjectHeader* obj) {
+    Bin* bin = obj->bin;
+    assert(bin != NULL);
+    bin->unlink(obj);
+    if (bin->empty()) {
+      size_t bin_idx = bin - _bins;
+      _binmap[bin_idx / WORD_BITS] &= ~(static_cast<size_t>(1) << (bin_idx % WORD_BITS));
     }
-    assert((uintptr_t)obj->bin_prev % 16 == 0);
-    assert((uintptr_t)obj->bin_next % 16 == 0);
+  }
+
+  // @return the first bin at or above start with a free run in it, or
+  // NUM_BINS_TOTAL if there is none.
+  inline size_t firstNonEmptyBin(size_t start) const {
+    size_t word = start / WORD_BITS;
+    if (word >= BINMAP_WORDS) {
+      return NUM_BINS_TOTAL;
+    }
+    size_t bits = _binmap[word] & (~static_cast<size_t>(0) << (start % WORD_BITS));
+    while (bits == 0) {
+      word += 1;
+      if (word == BINMAP_WORDS) {
+        return NUM_BINS_TOTAL;
+      }
+      bits = _binmap[word];
+    }
+    return word * WORD_BITS + __builtin_ctzl(bits);
   }
   
   size_t _size;
   Page* _heap;
+  ObjectHeader* _headers;
+
+  // Pages at and above this index have never been handed out, and are
+  // PROT_NONE rather than guarded. Only used when GuardPages::available().
+  size_t _frontier;
   Bin _bins[NUM_BINS_TOTAL];
+
+  // One bit per bin, set iff the bin is non-empty.
+  size_t _binmap[BINMAP_WORDS];
+
+  // Released runs waiting to be coalesced, by exact size, newest first.
+  ObjectHeader* _fast[DeferCoalescing ? NUM_FAST_BINS : 1];
+  size_t _num_fast;
+
+  // Freed runs that are still readable and writable.
+  ObjectHeader* _deferred[DeferredFrees > 0 ? DeferredFrees : 1];
+  size_t _num_deferred;
+
+  // Mallocs and frees since the oldest deferred run was freed.
+  size_t _deferred_age;
+
+  // Protected runs waiting to be released, by size bucket, and the bytes
+  // of address space they all hold.
+  Quarantine _quarantine[QUARANTINE_BUCKETS];
+  size_t _quarantined_bytes;
 };
 
 #endif
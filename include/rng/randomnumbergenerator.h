@@ -11,25 +11,84 @@
 #define DH_RANDOMNUMBERGENERATOR_H
 
 
-#include "mwc.h"
+#include <pthread.h>
+#include <stdint.h>
+
 #include "realrandomvalue.h"
+#include "xoshiro256.h"
+
+// When set, each thread's generator lives in initial-exec TLS: a plain
+// offset from the thread pointer, instead of a call to __tls_get_addr
+// on every access from a shared library. Only for libraries that are
+// preloaded or linked at startup; one loaded with dlopen() may find no
+// static TLS left for it and fail to load.
+#ifndef RNG_INITIAL_EXEC_TLS
+#define RNG_INITIAL_EXEC_TLS 0
+#endif
 
 
 class RandomNumberGenerator {
 public:
 
-  RandomNumberGenerator() // (unsigned int seed1, unsigned int seed2) 
-    : mt (RealRandomValue::value(), RealRandomValue::value()) {
-    // : mt (362436069, 521288629)  {
-  }
+  RandomNumberGenerator() {}
 
-  inline unsigned int next (void) {
-    return mt.next();
+  /// @return 64 random bits.
+  /// Each thread draws from its own generator, seeded on first use, so
+  /// the allocation path shares no RNG state between threads and a
+  /// generator costs nothing to construct. Values are made BATCH at a
+  /// time, so a call is usually just a load from the thread's buffer.
+  /// A forked child reseeds rather than repeat its parent's values.
+  inline uint64_t next (void) {
+    ThreadState& state = threadState();
+    if (state.available == 0) {
+      refill (state);
+    }
+    return state.values[--state.available];
   }
 
 private:
 
-   MWC mt;
+  enum { LANES = 4 };
+  enum { BATCH = 64 };
+
+  struct ThreadState {
+    Xoshiro256<LANES> generator;
+    uint64_t values[BATCH];
+    unsigned int available;
+    bool seeded;
+  };
+
+  static inline ThreadState& threadState (void) {
+#if RNG_INITIAL_EXEC_TLS
+    static __thread ThreadState state __attribute__((tls_model ("initial-exec")));
+#else
+    static __thread ThreadState state;
+#endif
+    return state;
+  }
+
+  // Only the forking thread lives on in the child; its buffered values
+  // and generator are the parent's.
+  static void forgetInChild (void) {
+    ThreadState& state = threadState();
+    state.available = 0;
+    state.seeded = false;
+  }
+
+  static void registerFork (void) {
+    pthread_atfork (NULL, NULL, forgetInChild);
+  }
+
+  static __attribute__((noinline)) void refill (ThreadState& state) {
+    if (!state.seeded) {
+      static pthread_once_t registered = PTHREAD_ONCE_INIT;
+      pthread_once (&registered, registerFork);
+      state.generator.seed (((uint64_t) RealRandomValue::value() << 32) | RealRandomValue::value());
+      state.seeded = true;
+    }
+    state.generator.fill (state.values, BATCH);
+    state.available = BATCH;
+  }
 
 };
 
@@ -15,16 +15,31 @@
 #include <stdlib.h>
 
 
-#if defined(linux) || defined(__APPLE__)
+#if defined(linux) || defined(__linux__) || defined(__APPLE__)
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include <stdint.h>
+
+#include "splitmix64.h"
+
 /**
  * @class RealRandomValue
  * @brief Uses a real source of randomness to generate some random values.
+ *
+ * The system is asked for randomness once per process, and again in
+ * each forked child: a 64-bit seed from getrandom() (or /dev/urandom
+ * where that is missing, or the clock as a last resort). Every value is
+ * then SplitMix64 of the seed and a shared counter, so calls cost no
+ * system calls and work in chroots without /dev.
+ *
  * @author Emery Berger <http://www.cs.umass.edu/~emery>
  */
 
@@ -32,6 +47,7 @@
 #include <windows.h>
 #include <Wincrypt.h>
 #else
+#include <pthread.h>
 #include <sys/time.h>
 #include <unistd.h>
 #endif
@@ -42,38 +58,69 @@ public:
   {}
 
   static unsigned int value (void) {
+    State& s = state();
+    uint64_t n = __sync_fetch_and_add (&s.counter, 1);
+    return (unsigned int) (SplitMix64::mix (s.seed + n * SplitMix64::GAMMA) >> 32);
+  }
+
+private:
+
+  struct State {
+    uint64_t seed;
+    uint64_t counter;
+  };
+
+  static State& state (void) {
+    // Set up exactly once, by whichever thread gets here first.
+    static State s = initialState();
+    return s;
+  }
+
+  static State initialState (void) {
+#if !defined(_WIN32)
+    // Otherwise a forked child repeats its parent's values.
+    pthread_atfork (NULL, NULL, reseed);
+#endif
+    State s = { systemSeed() | 1, 0 };
+    return s;
+  }
+
+  static void reseed (void) {
+    State& s = state();
+    s.seed = systemSeed() | 1;
+    s.counter = 0;
+  }
+
+  static uint64_t systemSeed (void) {
+    uint64_t v = 0;
 #if defined(_WIN32)
 
     HCRYPTPROV   hCryptProv;
-    BYTE         pbData[16];
 
     CryptAcquireContext (&hCryptProv, NULL, NULL, PROV_RSA_FULL, 0);
-    CryptGenRandom (hCryptProv, 8, pbData);
-    unsigned int v = *((unsigned int *) &pbData) | 1;
+    CryptGenRandom (hCryptProv, sizeof(v), (BYTE *) &v);
     return v;
-#elif defined(linux) || defined(__APPLE__)
-    // Pull random values out of /dev/urandom.
-    unsigned int v;
-
-    int fn = open ("/dev/urandom", O_RDONLY);
-    if (fn == -1) {
-      printf ("FAILED TO OPEN /dev/urandom.\n");
-      abort();
+#else
+#if defined(__linux__) && defined(SYS_getrandom)
+    if (syscall (SYS_getrandom, &v, sizeof(v), 0) == (long) sizeof(v)) {
+      return v;
     }
-    
-    if (read(fn, &v, sizeof(unsigned int)) != sizeof(unsigned int)) {
-      printf ("FAILED TO READ FROM /dev/urandom.\n");
-      abort();
+#endif
+#if defined(linux) || defined(__linux__) || defined(__APPLE__)
+    // Older kernels: pull the seed out of /dev/urandom.
+    int fn = open ("/dev/urandom", O_RDONLY);
+    if (fn != -1) {
+      ssize_t n = read (fn, &v, sizeof(v));
+      close (fn);
+      if (n == (ssize_t) sizeof(v)) {
+	return v;
+      }
     }
-
-    close (fn);
-    return v;
-#else
+#endif
     // Not really random...
-    unsigned int v;
     struct timeval tp;
     gettimeofday (&tp, NULL);
-    v = getpid() + tp.tv_usec + tp.tv_sec;
+    v = ((uint64_t) getpid() << 32) ^ ((uint64_t) tp.tv_sec * 1000000 + tp.tv_usec);
     return v;
 #endif
   }
@@ -0,0 +1,49 @@
+// -*- C++ -*-
+
+/**
+ * @file   splitmix64.h
+ * @brief  SplitMix64, for turning one seed into many.
+ */
+
+#ifndef DH_SPLITMIX64_H
+#define DH_SPLITMIX64_H
+
+#include <stdint.h>
+
+/**
+ * @class SplitMix64
+ * @brief Steele, Lea and Flood's SplitMix64 generator.
+ *
+ * Its output function is a bijection that mixes well even between
+ * consecutive inputs, so mix(seed + n * GAMMA) turns one seed and a
+ * counter into a stream of independent-looking values. It is the
+ * recommended way to seed the xoshiro generators.
+ */
+class SplitMix64 {
+public:
+
+  // 2^64 divided by the golden ratio.
+  static const uint64_t GAMMA = 0x9E3779B97F4A7C15ULL;
+
+  SplitMix64 (uint64_t seed)
+    : _state (seed)
+  {}
+
+  inline uint64_t next (void) {
+    _state += GAMMA;
+    return mix (_state);
+  }
+
+  static inline uint64_t mix (uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+private:
+
+  uint64_t _state;
+
+};
+
+#endif
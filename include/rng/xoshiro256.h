@@ -0,0 +1,85 @@
+// -*- C++ -*-
+
+/**
+ * @file   xoshiro256.h
+ * @brief  xoshiro256++, several streams at a time.
+ */
+
+#ifndef DH_XOSHIRO256_H
+#define DH_XOSHIRO256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "splitmix64.h"
+
+/**
+ * @class Xoshiro256
+ * @brief Blackman and Vigna's xoshiro256++, as Lanes independent streams
+ *        advanced in lockstep.
+ *
+ * fill() computes Lanes values per step in loops with no dependence
+ * between lanes, which compilers turn into SIMD code (two lanes per SSE2
+ * register, four per AVX2 register). The state is plain data, so it can
+ * live in thread-local storage, and must be seeded before use.
+ */
+template <size_t Lanes>
+class Xoshiro256 {
+public:
+
+  void seed (uint64_t value) {
+    // No lane may start all zero; SplitMix64 output practically never is.
+    SplitMix64 sm (value);
+    for (size_t l = 0; l < Lanes; l++) {
+      _s0[l] = sm.next();
+      _s1[l] = sm.next();
+      _s2[l] = sm.next();
+      _s3[l] = sm.next();
+    }
+  }
+
+  /// Writes n random values to out; n must be a multiple of Lanes.
+  inline void fill (uint64_t * out, size_t n) {
+    // Work on local copies: out might otherwise alias the state, which
+    // would keep the lane loop from vectorizing.
+    uint64_t s0[Lanes], s1[Lanes], s2[Lanes], s3[Lanes];
+    for (size_t l = 0; l < Lanes; l++) {
+      s0[l] = _s0[l];
+      s1[l] = _s1[l];
+      s2[l] = _s2[l];
+      s3[l] = _s3[l];
+    }
+    for (size_t i = 0; i < n; i += Lanes) {
+      for (size_t l = 0; l < Lanes; l++) {
+	out[i + l] = rotl (s0[l] + s3[l], 23) + s0[l];
+	const uint64_t t = s1[l] << 17;
+	s2[l] ^= s0[l];
+	s3[l] ^= s1[l];
+	s1[l] ^= s2[l];
+	s0[l] ^= s3[l];
+	s2[l] ^= t;
+	s3[l] = rotl (s3[l], 45);
+      }
+    }
+    for (size_t l = 0; l < Lanes; l++) {
+      _s0[l] = s0[l];
+      _s1[l] = s1[l];
+      _s2[l] = s2[l];
+      _s3[l] = s3[l];
+    }
+  }
+
+private:
+
+  static inline uint64_t rotl (uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+  }
+
+  uint64_t _s0[Lanes];
+  uint64_t _s1[Lanes];
+  uint64_t _s2[Lanes];
+  uint64_t _s3[Lanes];
+
+};
+
+#endif
@@ -0,0 +1,40 @@
+// -*- C++ -*-
+
+#ifndef DH_STATICSWITCH_H
+#define DH_STATICSWITCH_H
+
+#include <assert.h>
+
+/**
+ * @class StaticSwitch
+ * @brief Runs C<index>::run (v) for a run-time index in [From, From + Cases).
+ *
+ * The case is found by binary search on the index, and every C<i> is
+ * visible at the call site, so each one can be inlined -- unlike a call
+ * through a virtual function or a table of function pointers.
+ */
+template <int From, int Cases, template <int> class C, typename R, typename V>
+class StaticSwitch {
+  enum { HALF = Cases / 2 };
+public:
+  static inline R run (int index, V v)
+  {
+    if (index < From + HALF) {
+      return StaticSwitch<From, HALF, C, R, V>::run (index, v);
+    } else {
+      return StaticSwitch<From + HALF, Cases - HALF, C, R, V>::run (index, v);
+    }
+  }
+};
+
+template <int From, template <int> class C, typename R, typename V>
+class StaticSwitch<From, 1, C, R, V> {
+public:
+  static inline R run (int index, V v)
+  {
+    assert (index == From);
+    return C<From>::run (v);
+  }
+};
+
+#endif
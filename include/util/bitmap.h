@@ -46,23 +46,23 @@ enum { WORDBITSHIFT = StaticLog<WORDBITS>::VALUE };
 
 static inline void clear(WORD* bits, unsigned long long n) {
   assert(bits != NULL);
-  unsigned bytes = n / 8;
+  size_t bytes = n / 8;
   memset(static_cast<void*>(bits), 0, bytes);
 }
 
 static inline bool isSet(const WORD* bits, unsigned long long n, unsigned long long index) {
   assert(bits != NULL);
   assert (index < n);
-  const unsigned int item = index >> WORDBITSHIFT;
-  const unsigned int position = index - (item << WORDBITSHIFT);
+  const size_t item = index >> WORDBITSHIFT;
+  const size_t position = index - (item << WORDBITSHIFT);
   assert (item < n / WORDBYTES);
   bool result = bits[item] & (getMask(position));
   return result;
 }
   static inline bool tryToSet(WORD* bits, unsigned long long n, unsigned long long index) {
     assert (index < n);
-    const unsigned int item = index >> WORDBITSHIFT;
-    const unsigned int position = index & (WORDBITS - 1);
+    const size_t item = index >> WORDBITSHIFT;
+    const size_t position = index & (WORDBITS - 1);
     assert (item < n / WORDBYTES);
     unsigned long oldvalue;
     const WORD mask = getMask(position);
@@ -74,8 +74,8 @@ static inline bool isSet(const WORD* bits, unsigned long long n, unsigned long l
   /// Clears the bit at the given index.
   static inline bool reset(WORD* bits, unsigned long long n, unsigned long long index) {
     assert (index < n);
-    const unsigned int item = index >> WORDBITSHIFT;
-    const unsigned int position = index & (WORDBITS - 1);
+    const size_t item = index >> WORDBITSHIFT;
+    const size_t position = index & (WORDBITS - 1);
     assert (item < n / WORDBYTES);
     unsigned long oldvalue;
     oldvalue = bits[item];
@@ -107,7 +107,7 @@ public:
     // Round up the number of elements.
     _elements = BitMapImpl::WORDBITS * ((nelts + BitMapImpl::WORDBITS - 1) /BitMapImpl:: WORDBITS);
     // Allocate the right number of bytes.
-    unsigned int nbytes = _elements / BitMapImpl::WORDBYTES;
+    size_t nbytes = _elements / 8;
     void * buf = Heap::malloc ((size_t) nbytes);
     _bitarray = (WORD *) buf;
     clear();
@@ -116,27 +116,27 @@ public:
   /// Clears out the bitmap array.
   void clear (void) {
     if (_bitarray != NULL) {
-      BitMapImpl::clear(_bitarray, _elements * BitMapImpl::WORDBITS);
+      BitMapImpl::clear(_bitarray, _elements);
     }
   }
 
   /// @return true iff the bit was not set (but it is now).
   inline bool tryToSet (unsigned long long index) {
     return BitMapImpl::tryToSet(_bitarray,
-                                _elements * BitMapImpl::WORDBITS,
+                                _elements,
                                 index);
   }
 
   /// Clears the bit at the given index.
   inline bool reset (unsigned long long index) {
     return BitMapImpl::reset(_bitarray,
-                                _elements * BitMapImpl::WORDBITS,
+                                _elements,
                                 index);
   }
 
   inline bool isSet (unsigned long long index) const {
     return BitMapImpl::isSet(_bitarray,
-                             _elements * BitMapImpl::WORDBITS,
+                             _elements,
                              index);
   }
 
@@ -148,7 +148,7 @@ private:
   WORD * _bitarray;
   
   /// The number of elements in the array.
-  unsigned int _elements;
+  size_t _elements;
 
 };
 
@@ -0,0 +1,114 @@
+// -*- C++ -*-
+
+/**
+ * @file   guardpages.h
+ * @brief  Inaccessible pages, preferably without splitting mappings.
+ */
+
+#ifndef DH_GUARDPAGES_H
+#define DH_GUARDPAGES_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(__linux__) && !defined(MADV_GUARD_INSTALL)
+// Linux 6.13 and up; older headers do not know about them.
+#define MADV_GUARD_INSTALL 102
+#define MADV_GUARD_REMOVE  103
+#endif
+
+/**
+ * @class GuardPages
+ * @brief Makes page ranges fault on any access, and undoes it.
+ *
+ * Where the kernel supports MADV_GUARD_INSTALL, guards are installed in
+ * the page tables and the mapping is left alone, so any number of
+ * guarded ranges costs a single VMA. Otherwise we fall back to
+ * mprotect(PROT_NONE), which splits the mapping at every boundary.
+ *
+ * NB: unlike mprotect, installing a guard discards the contents of the
+ * pages, and removing it leaves them zero-filled. Only use this on memory
+ * whose contents are dead.
+ */
+class GuardPages {
+public:
+
+  /// Makes [ptr, ptr + sz) inaccessible.
+  /// @return 0 on success, or an errno value.
+  static int protect (void * ptr, size_t sz) {
+#if defined(MADV_GUARD_INSTALL)
+    if (available()) {
+      return (madvise (ptr, sz, MADV_GUARD_INSTALL) == 0) ? 0 : errno;
+    }
+#endif
+    return (mprotect (ptr, sz, PROT_NONE) == 0) ? 0 : errno;
+  }
+
+  /// Makes [ptr, ptr + sz) readable and writable again.
+  /// @return 0 on success, or an errno value.
+  static int unprotect (void * ptr, size_t sz) {
+#if defined(MADV_GUARD_INSTALL)
+    if (available()) {
+      return (madvise (ptr, sz, MADV_GUARD_REMOVE) == 0) ? 0 : errno;
+    }
+#endif
+    return (mprotect (ptr, sz, PROT_READ | PROT_WRITE) == 0) ? 0 : errno;
+  }
+
+  /// @return true iff guards are installed without splitting mappings.
+  static bool available (void) {
+#if defined(MADV_GUARD_INSTALL)
+    // Probed once; the initialization of a local static is thread safe.
+    static const bool status = probe();
+    return status;
+#else
+    return false;
+#endif
+  }
+
+  /// @return the number of mappings (VMAs) in this process, or 0 if it
+  /// cannot be determined. Does not allocate, so it is safe to call from
+  /// inside the allocator.
+  static size_t mappingCount (void) {
+#if defined(__linux__)
+    int fd = open ("/proc/self/maps", O_RDONLY);
+    if (fd == -1) {
+      return 0;
+    }
+    char buf[4096];
+    size_t lines = 0;
+    ssize_t n;
+    while ((n = read (fd, buf, sizeof(buf))) > 0) {
+      for (ssize_t i = 0; i < n; i++) {
+        lines += (buf[i] == '\n');
+      }
+    }
+    close (fd);
+    return lines;
+#else
+    return 0;
+#endif
+  }
+
+private:
+
+#if defined(MADV_GUARD_INSTALL)
+  static bool probe (void) {
+    const size_t sz = getpagesize();
+    void * page = mmap (NULL, sz, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED) {
+      return false;
+    }
+    bool ok = (madvise (page, sz, MADV_GUARD_INSTALL) == 0);
+    munmap (page, sz);
+    return ok;
+  }
+#endif
+
+};
+
+#endif
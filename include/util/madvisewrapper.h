@@ -13,6 +13,11 @@
 #include <sys/mman.h>
 #endif
 
+#if (defined(linux) || defined(__linux__)) && !defined(MADV_POPULATE_WRITE)
+// Linux 5.14 and up; older headers do not know about it.
+#define MADV_POPULATE_WRITE 23
+#endif
+
 
 #include "heaplayers.h"
 // #include "mmapwrapper.h"
@@ -59,8 +64,18 @@ public:
     }
   }
 
+  // Fault in the given range of memory, writable, without changing its
+  // contents. Returns false if the kernel cannot.
+  static bool populate (void * ptr, size_t sz) {
+#if (defined(linux) || defined(__linux__))
+    return madvise (ptr, sz, MADV_POPULATE_WRITE) == 0;
+#else
+    return false;
+#endif
+  }
+
   static void huge (void * ptr, size_t sz) {
-#if defined(linux) && defined(MADV_HUGEPAGE)
+#if (defined(linux) || defined(__linux__)) && defined(MADV_HUGEPAGE)
     madvise (ptr, sz, MADV_HUGEPAGE);
 #endif
   }
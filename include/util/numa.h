@@ -0,0 +1,142 @@
+// -*- C++ -*-
+
+/**
+ * @file   numa.h
+ * @brief  Just enough NUMA support to place memory near its threads.
+ */
+
+#ifndef DH_NUMA_H
+#define DH_NUMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+/**
+ * @class Numa
+ * @brief Node count, current node and memory placement, without libnuma.
+ *
+ * Nodes are numbered by their rank among the online nodes, from 0 to
+ * nodeCount() - 1, which is the kernel's numbering unless some nodes
+ * are offline. Nodes from MAX_NODES on are ignored.
+ *
+ * On machines (or kernels) without NUMA support, there is one node, the
+ * calling thread is always on it, and bind() does nothing.
+ */
+class Numa {
+public:
+
+  enum { MAX_NODES = sizeof(unsigned long) * 8 };
+
+  /// @return the number of online NUMA nodes, at least 1.
+  static size_t nodeCount (void) {
+    return __builtin_popcountl (onlineNodes());
+  }
+
+  /// @return the node the calling thread is running on. Threads migrate
+  /// rarely, so the answer is cached and only refreshed every
+  /// REFRESH_INTERVAL calls.
+  static size_t currentNode (void) {
+#if defined(__linux__) && defined(SYS_getcpu)
+    static __thread unsigned int node;
+    static __thread unsigned int calls;
+    if (calls++ % REFRESH_INTERVAL == 0) {
+      unsigned int cpu, id;
+      if (syscall (SYS_getcpu, &cpu, &id, NULL) != 0 || id >= MAX_NODES) {
+	id = 0;
+      }
+      node = __builtin_popcountl (onlineNodes() & ((1UL << id) - 1));
+    }
+    return node;
+#else
+    return 0;
+#endif
+  }
+
+  /// Asks for the pages of [ptr, ptr + sz) to be placed on `node` when
+  /// they are first touched. The kernel falls back to other nodes rather
+  /// than fail if that node runs out.
+  /// @return true on success. Failure (without CONFIG_NUMA, or under a
+  /// seccomp filter) only costs locality, so callers may ignore it.
+  static bool bind (void * ptr, size_t sz, size_t node) {
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long online = onlineNodes();
+    if (node >= (size_t) __builtin_popcountl (online)) {
+      return false;
+    }
+    // The node's kernel id is the position of its online bit.
+    for (; node > 0; node--) {
+      online &= online - 1;
+    }
+    unsigned long mask = online & -online;
+    // maxnode counts one past the highest bit the kernel looks at.
+    return syscall (SYS_mbind, ptr, sz, MPOL_PREFERRED_MODE, &mask,
+		    sizeof(mask) * 8 + 1, 0) == 0;
+#else
+    return false;
+#endif
+  }
+
+private:
+
+  enum { REFRESH_INTERVAL = 64 };
+
+  // MPOL_PREFERRED, from <numaif.h>, which we do not depend on.
+  enum { MPOL_PREFERRED_MODE = 1 };
+
+  /// @return one bit per online node, by kernel id.
+  static unsigned long onlineNodes (void) {
+    static const unsigned long nodes = readOnlineNodes();
+    return nodes;
+  }
+
+  static unsigned long readOnlineNodes (void) {
+#if defined(__linux__)
+    // e.g. "0-3,6\n", or just "0\n". Possible nodes may never come
+    // online, so they would get ranges that no thread allocates from.
+    int fd = open ("/sys/devices/system/node/online", O_RDONLY);
+    if (fd == -1) {
+      return 1;
+    }
+    char buf[256];
+    ssize_t n = read (fd, buf, sizeof(buf) - 1);
+    close (fd);
+    if (n <= 0) {
+      return 1;
+    }
+    buf[n] = '\0';
+    unsigned long mask = 0;
+    size_t first = 0, id = 0;
+    bool digits = false, range = false;
+    for (ssize_t i = 0; i <= n; i++) {
+      if (buf[i] >= '0' && buf[i] <= '9') {
+	id = id * 10 + (buf[i] - '0');
+	digits = true;
+      } else if (buf[i] == '-') {
+	first = id;
+	id = 0;
+	range = true;
+      } else {
+	if (digits) {
+	  for (size_t k = range ? first : id; k <= id && k < MAX_NODES; k++) {
+	    mask |= 1UL << k;
+	  }
+	}
+	id = 0;
+	digits = range = false;
+      }
+    }
+    return (mask != 0) ? mask : 1;
+#else
+    return 1;
+#endif
+  }
+
+};
+
+#endif
@@ -0,0 +1,142 @@
+// -*- C++ -*-
+
+/**
+ * @file   shadowmap.h
+ * @brief  One shadow byte per Granularity heap bytes.
+ */
+
+#ifndef DH_SHADOWMAP_H
+#define DH_SHADOWMAP_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @class ShadowMap
+ * @brief Records which bytes of a heap range are addressable.
+ *
+ * Each shadow byte describes one granule of Granularity heap bytes:
+ * a value k from 1 to Granularity means the first k bytes of the granule
+ * are addressable, UNADDRESSABLE means none are (never allocated, or a
+ * redzone), and FREED means the granule belongs to a freed object.
+ *
+ * The shadow memory is supplied by the caller and must start out zero,
+ * i.e. all UNADDRESSABLE. Fresh anonymous mappings are, and their pages
+ * are only populated as the heap they shadow is used.
+ */
+template <size_t Granularity>
+class ShadowMap {
+public:
+
+  enum { UNADDRESSABLE = 0 };
+  enum { FREED = 0xFD };
+
+  ShadowMap (void)
+    : _base (0),
+      _shadow (NULL)
+  {}
+
+  /// Shadows the heap starting at base; the shadow of base + i is
+  /// at shadow + i / Granularity.
+  void initialize (void * base, void * shadow) {
+    assert ((uintptr_t) base % Granularity == 0);
+    _base = (uintptr_t) base;
+    _shadow = (uint8_t *) shadow;
+  }
+
+  /// Marks the first sz bytes of [ptr, ptr + capacity) addressable and
+  /// the rest a redzone.
+  inline void unpoison (void * ptr, size_t sz, size_t capacity) {
+    uint8_t * s = shadowFor (ptr);
+    size_t full = sz / Granularity;
+    memset (s, Granularity, full);
+    if (sz % Granularity != 0) {
+      s[full++] = sz % Granularity;
+    }
+    memset (s + full, UNADDRESSABLE, capacity / Granularity - full);
+  }
+
+  /// Marks every granule of [ptr, ptr + sz) with value.
+  inline void poison (void * ptr, size_t sz, uint8_t value) {
+    memset (shadowFor (ptr), value, sz / Granularity);
+  }
+
+  /// @return the shadow byte of the granule holding ptr.
+  inline uint8_t get (void * ptr) {
+    return *shadowFor (ptr);
+  }
+
+  /// @return true iff every byte of [ptr, ptr + sz) is addressable.
+  bool isAddressable (void * ptr, size_t sz) {
+    uintptr_t addr = (uintptr_t) ptr;
+    const uintptr_t end = addr + sz;
+    while (addr < end) {
+      uint8_t s = *shadowFor ((void *) addr);
+      uintptr_t granuleEnd = (addr | (Granularity - 1)) + 1;
+      uintptr_t last = ((end < granuleEnd) ? end : granuleEnd) - 1;
+      if (s == FREED || (last % Granularity) >= s) {
+	return false;
+      }
+      addr = granuleEnd;
+    }
+    return true;
+  }
+
+  /// @return how many bytes from ptr on, up to capacity, are
+  /// addressable before the first one that is not.
+  inline size_t addressable (void * ptr, size_t capacity) {
+    const uint8_t * s = shadowFor (ptr);
+    size_t n = 0;
+    for (size_t i = 0; i < capacity / Granularity; i++) {
+      if (s[i] > Granularity) {
+	break;
+      }
+      n += s[i];
+      if (s[i] != Granularity) {
+	break;
+      }
+    }
+    return n;
+  }
+
+  /// @return true iff every granule of [ptr, ptr + sz) is marked value.
+  inline bool all (void * ptr, size_t sz, uint8_t value) {
+    const uint8_t * s = shadowFor (ptr);
+    const size_t n = sz / Granularity;
+    size_t i = 0;
+    // Mismatches are OR-ed together a block at a time, with no branch
+    // per byte, so that the inner loop vectorizes.
+    for (; i + CHECK_BLOCK <= n; i += CHECK_BLOCK) {
+      uint8_t diff = 0;
+      for (size_t j = 0; j < CHECK_BLOCK; j++) {
+	diff |= s[i + j] ^ value;
+      }
+      if (diff != 0) {
+	return false;
+      }
+    }
+    for (; i < n; i++) {
+      if (s[i] != value) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+private:
+
+  enum { CHECK_BLOCK = 64 };
+
+  inline uint8_t * shadowFor (void * ptr) {
+    assert ((uintptr_t) ptr >= _base);
+    return _shadow + ((uintptr_t) ptr - _base) / Granularity;
+  }
+
+  uintptr_t _base;
+  uint8_t * _shadow;
+
+};
+
+#endif
@@ -1,7 +1,10 @@
+#include <bigheap.h>
 #include <checkheap3.h>
 #include <combineheap.h>
 #include <mmapalloc.h>
 
+#include <pthread.h>
+
 #include <static/staticlog.h>
 #include <locks/posixlock.h>
 #include <heaps/top/mmapheap.h>
@@ -15,11 +18,88 @@ using namespace HL;
 enum { PageSize = 4096 };
 enum { Quarantine = 32,
        MinSize = MallocInfo::MinSize,
-       MaxSize = PageSize / 2,
+       MaxSize = 1 << 18,
        ChunkSize = 1 << 16,
-       HeapSize = 1 << 30,
        Alignment = MallocInfo::Alignment };
 
+// Address space reserved for objects up to MaxSize.
+const size_t HeapSize = (size_t) 1 << (sizeof(void*) == 8 ? 32 : 30);
+
+// Address space reserved for objects larger than MaxSize.
+const size_t BigHeapSize = (size_t) 1 << (sizeof(void*) == 8 ? 35 : 30);
+
+// Address space that freed large objects hold, inaccessible and
+// discarded, before any of it is reused. It is split evenly between 16
+// power-of-two size buckets, so large frees only push out runs of
+// similar size.
+#ifndef CHECK_HEAP_BIG_QUARANTINE
+#define CHECK_HEAP_BIG_QUARANTINE (BigHeapSize / 4)
+#endif
+const size_t BigQuarantineBytes = CHECK_HEAP_BIG_QUARANTINE;
+
+// When set, large objects end against their trailing guard page, so an
+// overflow faults on its first byte. They are then only
+// MallocInfo::Alignment-aligned rather than page-aligned.
+#ifndef CHECK_HEAP_RIGHT_ALIGN
+#define CHECK_HEAP_RIGHT_ALIGN 0
+#endif
+
+// When set, the last page of every small-object chunk is a guard page.
+// Where guards cannot be installed without splitting mappings (before
+// Linux 6.13), each one costs two, so only the first 8192 chunks (512MB
+// of small objects) are guarded and later chunks go without.
+#ifndef CHECK_HEAP_CHUNK_GUARDS
+#define CHECK_HEAP_CHUNK_GUARDS 1
+#endif
+const size_t ChunkGuardSize = CHECK_HEAP_CHUNK_GUARDS ? PageSize : 0;
+
+// When set, freed small objects are canary-filled and checked again
+// when they are reused.
+#ifndef CHECK_HEAP_VALIDATE_ON_MALLOC
+#define CHECK_HEAP_VALIDATE_ON_MALLOC 1
+#endif
+
+// When set, small objects are tracked in a shadow map, one byte per 16
+// heap bytes, which validate() checks without touching the objects. An
+// overflow into an object's redzone is reported when it is freed, and a
+// write to a freed object when it is reused.
+#ifndef CHECK_HEAP_SHADOW
+#define CHECK_HEAP_SHADOW 0
+#endif
+
+// The number of cache-line offsets that successive chunks of a size
+// class rotate their objects through; 1 disables coloring. Coloring
+// leaves up to 7 cache lines between a chunk's last object and its
+// guard page: an overflow into them does not fault, but is reported
+// when that object is freed or the heap is validated.
+#ifndef CHECK_HEAP_CHUNK_COLORS
+#define CHECK_HEAP_CHUNK_COLORS 8
+#endif
+
+// When set, small objects live on transparent huge pages, and chunk
+// guards are replaced by one guard huge page per 32MB of heap.
+#ifndef CHECK_HEAP_HUGEPAGES
+#define CHECK_HEAP_HUGEPAGES 0
+#endif
+
+// The most NUMA nodes small objects are spread over, each thread
+// allocating from its own node's part of the heap; 1 disables this.
+// Machines with fewer nodes use as many as they have.
+#ifndef CHECK_HEAP_NUMA_NODES
+#define CHECK_HEAP_NUMA_NODES 1
+#endif
+
+// When set, a maintenance thread keeps chunks set up and faulted in
+// ahead of demand for the size classes that have been growing, so that
+// allocating threads do not pay for it. It sleeps until a class starts
+// a chunk.
+#ifndef CHECK_HEAP_PREFAULT
+#define CHECK_HEAP_PREFAULT 0
+#endif
+#if CHECK_HEAP_PREFAULT && !defined(CHECK_HEAP_THREADED)
+#error "CHECK_HEAP_PREFAULT requires CHECK_HEAP_THREADED."
+#endif
+
 class SourceHeap : public MmapHeap {
  public:
   inline bool free(void* ptr) {
@@ -28,11 +108,18 @@ class SourceHeap : public MmapHeap {
   }
 };
 
+class TheBigHeap : public BigHeap<SourceHeap, PageSize, BigHeapSize, BigQuarantineBytes, CHECK_HEAP_RIGHT_ALIGN> {};
+
+class TheSmallHeap : public CheckedHeap<SourceHeap, HeapSize, ChunkSize, Quarantine, MinSize, MaxSize, Alignment, ChunkGuardSize, CHECK_HEAP_VALIDATE_ON_MALLOC, CHECK_HEAP_SHADOW, CHECK_HEAP_CHUNK_COLORS, CHECK_HEAP_HUGEPAGES, CHECK_HEAP_NUMA_NODES> {};
+
+class CheckedHeapType : public
+  FatalWrapper<CombineHeap<TheSmallHeap, TheBigHeap> > {};
+
 class CheckedHeapWrapper : public
 #ifdef CHECK_HEAP_THREADED
-  LockedHeap<PosixLockType, FatalWrapper<CombineHeap<CheckedHeap<SourceHeap, HeapSize, ChunkSize, Quarantine, MinSize, MaxSize, Alignment>, SourceHeap> > > {};
+  LockedHeap<PosixLockType, CheckedHeapType> {};
 #else
-  FatalWrapper<CombineHeap<CheckedHeap<SourceHeap, HeapSize, ChunkSize, Quarantine, MinSize, MaxSize, Alignment>, SourceHeap> > {};
+  CheckedHeapType {};
 #endif
 
 class TheCustomHeapType : public ANSIWrapper<CheckedHeapWrapper> {};
@@ -44,6 +131,76 @@ inline static TheCustomHeapType* getCustomHeap() {
   return _theCustomHeap;
 }
 
+#if CHECK_HEAP_PREFAULT
+// Set, and signalled, when a class starts a chunk; the maintenance
+// thread waits for it. Taken inside the heap's lock, never around it.
+static pthread_mutex_t prefaultMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefaultWanted = PTHREAD_COND_INITIALIZER;
+static bool prefaultPending = false;
+
+static void wantSpares(void) {
+  pthread_mutex_lock(&prefaultMutex);
+  if (!prefaultPending) {
+    prefaultPending = true;
+    pthread_cond_signal(&prefaultWanted);
+  }
+  pthread_mutex_unlock(&prefaultMutex);
+}
+
+// The child has no maintenance thread, and its copy of the mutex may
+// have been taken by another thread when it forked.
+static void resetPrefault(void) {
+  pthread_mutex_init(&prefaultMutex, NULL);
+  pthread_cond_init(&prefaultWanted, NULL);
+}
+
+static void* prefaultLoop(void*) {
+  enum { Batch = 16 };
+  TheCustomHeapType* heap = getCustomHeap();
+  TheSmallHeap& small = heap->getSmallHeap();
+  TheSmallHeap::Spare spares[Batch];
+  for (;;) {
+    pthread_mutex_lock(&prefaultMutex);
+    while (!prefaultPending) {
+      pthread_cond_wait(&prefaultWanted, &prefaultMutex);
+    }
+    prefaultPending = false;
+    pthread_mutex_unlock(&prefaultMutex);
+    heap->lock();
+    size_t n = small.reserveSpares(spares, Batch);
+    heap->unlock();
+    if (n == 0) {
+      continue;
+    }
+    // Page faults happen here, with the heap unlocked.
+    for (size_t i = 0; i < n; ++i) {
+      small.prefault(spares[i]);
+    }
+    heap->lock();
+    small.publishSpares(spares, n);
+    heap->unlock();
+  }
+  return NULL;
+}
+
+// Starts the maintenance thread when the library is loaded. A forked
+// child does not inherit it, and simply goes without spares.
+static class PrefaultThread {
+ public:
+  PrefaultThread() {
+    pthread_atfork(NULL, NULL, resetPrefault);
+    TheCustomHeapType* heap = getCustomHeap();
+    heap->lock();
+    heap->getSmallHeap().onSpareDemand(wantSpares);
+    heap->unlock();
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, prefaultLoop, NULL) == 0) {
+      pthread_detach(thread);
+    }
+  }
+} thePrefaultThread;
+#endif
+
 extern "C" {
   void* xxmalloc(size_t sz) {
     return getCustomHeap()->malloc(sz);
@@ -0,0 +1,97 @@
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <heaps/top/mmapheap.h>
+#include <checkheap3.h>
+
+// Each case runs checkheap3's CheckedHeap in a child process and expects
+// it to die of a given signal: a fault on a chunk's guard page, or an
+// abort from a canary check.
+
+enum { PageSize = 4096, ChunkSize = 1 << 16, ObjectSize = 1024 };
+
+class SourceHeap : public HL::MmapHeap {
+ public:
+  inline bool free(void* ptr) {
+    HL::MmapHeap::free(ptr);
+    return true;
+  }
+};
+
+// No quarantine, so a freed object is the next one handed out; guard
+// pages, canaries and 8 colors.
+typedef CheckedHeap<SourceHeap, 1 << 26, ChunkSize, 0, 16, 1 << 18, 16, PageSize, true, false, 8> Heap;
+
+// @return the last object of the class's `n`th chunk, which ends
+// `color` bytes short of the chunk's guard page.
+static char* lastObject(Heap& heap, size_t n, size_t color) {
+  for (;;) {
+    char* ptr = (char*)heap.malloc(ObjectSize);
+    uintptr_t end = ((uintptr_t)ptr | (ChunkSize - 1)) + 1 - PageSize - color;
+    if ((uintptr_t)ptr + ObjectSize == end && n-- == 0) {
+      return ptr;
+    }
+  }
+}
+
+// The first chunk of a class has no color, so its last object ends
+// against the guard.
+static void overflow(void) {
+  static Heap heap;
+  char* ptr = lastObject(heap, 0, 0);
+  ptr[ObjectSize - 1] = 1;
+  ptr[ObjectSize] = 1;
+}
+
+// Objects this large only have their first and last SAMPLE_BYTES checked.
+static void useAfterFree(void) {
+  static Heap heap;
+  char* ptr = (char*)heap.malloc(ObjectSize);
+  heap.free(ptr);
+  ptr[0] = 1;
+  heap.malloc(ObjectSize);
+}
+
+// The second chunk ends its objects one cache line short of the guard;
+// that line holds the canary, checked when the last object is freed.
+static void slackOverflow(void) {
+  static Heap heap;
+  char* ptr = lastObject(heap, 1, 64);
+  ptr[ObjectSize] = 1;
+  heap.free(ptr);
+}
+
+// @return true if run() in a child process dies of `signal`.
+static bool behaves(void (*run)(void), int signal) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    run();
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFSIGNALED(status) && WTERMSIG(status) == signal;
+}
+
+int main(int argc, char **argv) {
+  struct {
+    void (*run)(void);
+    int signal;
+    const char* failure;
+  } cases[] = {
+    { overflow, SIGSEGV, "write past a chunk's last object did not fault" },
+    { useAfterFree, SIGABRT, "write to a freed object was not reported on reuse" },
+    { slackOverflow, SIGABRT, "write to a chunk's color slack was not reported" },
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+    if (!behaves(cases[i].run, cases[i].signal)) {
+      fprintf(stderr, "%s.\n", cases[i].failure);
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,67 @@
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <heaplayers.h>
+#include <checkedheap.h>
+
+// A miniheap's never-allocated objects hold no canary of their own, only
+// the zeros they were mapped with. A write to one must still be reported,
+// both when the object is handed out and by validate().
+
+enum { ObjectSize = 64, NObjects = 64 };
+
+typedef HL::OneHeap<MmapAlloc> Allocator;
+
+class TestHeap : public RandomMiniCheckedHeap<2, 1, ObjectSize, NObjects, Allocator> {
+ public:
+  using RandomMiniCheckedHeap<2, 1, ObjectSize, NObjects, Allocator>::getObject;
+};
+
+static TestHeap heap;
+
+// @return true if check() aborts after every object is corrupted, in a
+// child process.
+static bool reported(void (*check)(void)) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    for (size_t i = 0; i < NObjects; ++i) {
+      ((char*)heap.getObject(i))[ObjectSize - 1] = 1;
+    }
+    check();
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+static void allocate(void) {
+  heap.malloc(ObjectSize);
+}
+
+static void validate(void) {
+  heap.validate();
+}
+
+int main(int argc, char **argv) {
+  heap.activate();
+  heap.validate();
+
+  if (!reported(allocate)) {
+    fprintf(stderr, "malloc handed out a corrupted object.\n");
+    return 1;
+  }
+  if (!reported(validate)) {
+    fprintf(stderr, "validate() missed a corrupted object.\n");
+    return 1;
+  }
+
+  // Untouched objects are handed out without complaint.
+  void* ptr = heap.malloc(ObjectSize);
+  heap.free(ptr);
+  heap.validate();
+  return 0;
+}
@@ -0,0 +1,175 @@
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <heaps/top/mmapheap.h>
+#include <regionheap.h>
+
+// Each case runs ProtectedPageAllocator in a child process and expects
+// it to exit cleanly or die of a given signal: a fault on a guard page
+// or a quarantined run, or an abort from a failed check.
+
+enum { PageSize = 4096, HeapSize = 1 << 24 };
+
+class SourceHeap : public HL::MmapHeap {
+ public:
+  inline bool free(void* ptr) {
+    HL::MmapHeap::free(ptr);
+    return true;
+  }
+};
+
+// Freed runs are protected at once, then held until 4 pages of runs of
+// similar size are quarantined behind: 64 pages over 16 size buckets.
+typedef ProtectedPageAllocator<SourceHeap, 4, PageSize, HeapSize, 0, 64 * PageSize> QuarantinedPages;
+
+// Freed runs wait in the deferred cache, and are reused at once.
+typedef ProtectedPageAllocator<SourceHeap, 4, PageSize, HeapSize, 8, 0> DeferredPages;
+
+typedef ProtectedPageAllocator<SourceHeap, 4, PageSize, HeapSize, 0, 64 * PageSize, true> RightAlignedPages;
+
+static void overflow(void) {
+  QuarantinedPages pages;
+  char* ptr = (char*)pages.malloc(3 * PageSize);
+  ptr[3 * PageSize - 1] = 1;
+  ptr[3 * PageSize] = 1;
+}
+
+static void useAfterFree(void) {
+  QuarantinedPages pages;
+  char* ptr = (char*)pages.malloc(PageSize);
+  pages.free(ptr);
+  ptr[0] = 1;
+}
+
+static void underflow(void) {
+  RightAlignedPages pages;
+  // volatile, so the compiler does not flag the underflow.
+  char* volatile ptr = (char*)pages.malloc(100);
+  ptr[-1] = 1;
+  pages.free(ptr);
+}
+
+// A freed run stays accessible in the deferred cache for at most 8 more
+// calls, even if they are all mallocs.
+static void deferredUseAfterFree(void) {
+  DeferredPages pages;
+  char* ptr = (char*)pages.malloc(PageSize);
+  pages.free(ptr);
+  for (int i = 0; i < 8; ++i) {
+    // Of another size, so the cached run is not simply reused.
+    pages.malloc(2 * PageSize);
+  }
+  ptr[0] = 1;
+}
+
+// A run is held back while the quarantine holds fewer than 4 pages freed
+// after it, and is the first choice for its size once released.
+static void reuse(void) {
+  QuarantinedPages pages;
+  void* runs[5];
+  for (int i = 0; i < 5; ++i) {
+    runs[i] = pages.malloc(PageSize);
+  }
+  pages.free(runs[0]);
+  void* other = pages.malloc(PageSize);
+  if (other == runs[0]) {
+    fprintf(stderr, "quarantined run reused.\n");
+    exit(1);
+  }
+  for (int i = 1; i < 5; ++i) {
+    pages.free(runs[i]);
+  }
+  if (pages.malloc(PageSize) != runs[0]) {
+    fprintf(stderr, "released run not reused.\n");
+    exit(1);
+  }
+}
+
+// A run far bigger than the whole quarantine only pushes out runs of its
+// own size.
+static void hugeFree(void) {
+  QuarantinedPages pages;
+  void* small = pages.malloc(PageSize);
+  pages.free(small);
+  pages.free(pages.malloc(256 * PageSize));
+  if (pages.malloc(PageSize) == small) {
+    fprintf(stderr, "small run pushed out of the quarantine.\n");
+    exit(1);
+  }
+}
+
+// Random allocations and frees of many sizes keep the run list, bins and
+// bitmap consistent (validate() asserts as much), and once everything is
+// freed, the runs coalesce back into one that spans the heap.
+static void roundTrip(void) {
+  enum { Slots = 64, Rounds = 4000 };
+  DeferredPages pages;
+  void* live[Slots] = { NULL };
+  srand(1);
+  for (int r = 0; r < Rounds; ++r) {
+    int i = rand() % Slots;
+    if (live[i] != NULL) {
+      pages.free(live[i]);
+      live[i] = NULL;
+    } else {
+      live[i] = pages.malloc((1 + rand() % 40) * PageSize - rand() % PageSize);
+      if (live[i] == NULL) {
+        exit(1);
+      }
+    }
+    pages.validate();
+  }
+  for (int i = 0; i < Slots; ++i) {
+    if (live[i] != NULL) {
+      pages.free(live[i]);
+    }
+  }
+  // One page goes to the run's guard.
+  if (pages.malloc(HeapSize - PageSize) == NULL) {
+    fprintf(stderr, "freed runs did not coalesce.\n");
+    exit(1);
+  }
+  pages.validate();
+}
+
+// @return true if run() in a child process dies of `signal`, or exits
+// cleanly if `signal` is 0.
+static bool behaves(void (*run)(void), int signal) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    run();
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (signal == 0) {
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+  return WIFSIGNALED(status) && WTERMSIG(status) == signal;
+}
+
+int main(int argc, char **argv) {
+  struct {
+    void (*run)(void);
+    int signal;
+    const char* failure;
+  } cases[] = {
+    { overflow, SIGSEGV, "write past a run did not fault" },
+    { useAfterFree, SIGSEGV, "write to a quarantined run did not fault" },
+    { deferredUseAfterFree, SIGSEGV, "write to a run freed 8 mallocs ago did not fault" },
+    { underflow, SIGABRT, "write to the slack in front of an object was not reported" },
+    { reuse, 0, "runs were not reused as the quarantine drained" },
+    { hugeFree, 0, "a huge free emptied the quarantine" },
+    { roundTrip, 0, "allocations and frees left the heap inconsistent" },
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+    if (!behaves(cases[i].run, cases[i].signal)) {
+      fprintf(stderr, "%s.\n", cases[i].failure);
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -7,7 +7,7 @@ GOOD="\033[32m"
 BAD="\033[31m"
 NORMAL="\033[0m"
 
-for test in danglingptr disaster doublefree illegalread test1 test2 test4 testsocket
+for test in chunkheap danglingptr disaster doublefree illegalread lazycanary pageheap shadow test1 test2 test4 testsocket
 do
   echo -n "Running test $test... "
   $TESTDIR/run.sh $TESTDIR/$test &>"$TESTLOG"
@@ -0,0 +1,69 @@
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <heaps/top/mmapheap.h>
+#include <checkheap3.h>
+
+// validate() on a shadowed heap passes while objects are used within
+// their requested sizes. A write into an object's redzone aborts when
+// the object is freed, and a write into a freed object aborts when it
+// is reused.
+
+class SourceHeap : public HL::MmapHeap {
+ public:
+  inline bool free(void* ptr) {
+    HL::MmapHeap::free(ptr);
+    return true;
+  }
+};
+
+// No quarantine, so a freed object is the next one handed out.
+typedef CheckedHeap<SourceHeap, 1 << 26, 1 << 16, 0, 16, 1 << 18, 16, 0, false, true> ShadowHeap;
+
+static ShadowHeap heap;
+
+// @return true if run() aborts in a child process.
+static bool reported(void (*run)(char*), char* ptr) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    run(ptr);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+static void overflow(char* ptr) {
+  // One past the 20 bytes requested, inside the 32-byte size class.
+  ptr[20] = 0;
+  heap.validate();
+  heap.free(ptr);
+}
+
+static void useAfterFree(char* ptr) {
+  heap.free(ptr);
+  ptr[0] = 0;
+  heap.validate();
+  heap.malloc(20);
+}
+
+int main(int argc, char **argv) {
+  char* live = (char*)heap.malloc(20);
+  memset(live, 1, 20);
+  heap.free(heap.malloc(20));
+  heap.validate();
+
+  if (!reported(overflow, live)) {
+    fprintf(stderr, "overflow into a redzone was not reported.\n");
+    return 1;
+  }
+  if (!reported(useAfterFree, live)) {
+    fprintf(stderr, "write to a freed object was not reported.\n");
+    return 1;
+  }
+  return 0;
+}